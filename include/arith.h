@@ -0,0 +1,7 @@
+#ifndef ARITH_H
+#define ARITH_H
+
+int arsh_arith_eval(const char *expr, long long *result);
+char **arsh_expand_arith(char **args);
+
+#endif
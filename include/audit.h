@@ -0,0 +1,23 @@
+#ifndef AUDIT_H
+#define AUDIT_H
+
+#include <time.h>
+
+#define ARSH_AUDIT_ARGV_MAX 3072
+
+// state of one command between arsh_audit_begin() and arsh_audit_end()
+struct arsh_audit_cmd {
+  int active;
+  struct timespec wall; // CLOCK_REALTIME start, for the record's timestamp
+  struct timespec start; // CLOCK_MONOTONIC start, for the duration
+  char argv[ARSH_AUDIT_ARGV_MAX]; // argv already encoded as a JSON array
+  int truncated;                  // argv did not fit and was cut short
+};
+
+void arsh_audit_init();
+void arsh_audit_begin(struct arsh_audit_cmd *cmd, char **args);
+void arsh_audit_end(struct arsh_audit_cmd *cmd, int status);
+void arsh_audit_flush();
+void arsh_audit_set_cwd(const char *dir);
+
+#endif
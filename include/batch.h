@@ -0,0 +1,8 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+int arsh_batch_needed(char **args);
+int arsh_launch_batched(char **args, int jobs);
+int arsh_batch_command(char **args);
+
+#endif
@@ -1,12 +1,21 @@
 #ifndef BUILTINS_H
 #define BUILTINS_H
 
+#include <stdio.h>
+
 int arsh_cd(char **args);
 int arsh_help(char **args);
 int arsh_exit(char **args);
 int arsh_export(char **args);
 int arsh_unset(char **args);
+int arsh_stats(char **args);
+int arsh_echo(char **args);
+int arsh_read(char **args);
+int arsh_let(char **args);
 int arsh_num_biultins();
+void arsh_set_thread_stdio(FILE *out, int in_fd);
+FILE *arsh_stdout();
+int arsh_stdin_fd();
 
 extern char *builtin_str[];
 extern int (*builtin_func[])(char **);
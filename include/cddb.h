@@ -0,0 +1,9 @@
+#ifndef CDDB_H
+#define CDDB_H
+
+#include <stddef.h>
+
+void arsh_cddb_add(const char *dir);
+int arsh_cddb_query(char **terms, char *out, size_t size);
+
+#endif
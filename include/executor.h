@@ -1,8 +1,10 @@
 #ifndef EXECUTOR_H
 #define EXECUTOR_H
 
+void arsh_redirect(char **args);
 int arsh_launch(char **args);
 int arsh_execute(char **args);
+int arsh_execute_line(char *line);
 int arsh_launch_pipeline(char **args);
 int arsh_launch_pipe(char **args, int pipe_pos);
 int arsh_logic_split(char **args);
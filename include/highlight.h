@@ -0,0 +1,35 @@
+#ifndef HIGHLIGHT_H
+#define HIGHLIGHT_H
+
+// lexer state before a byte of the line; a token boundary has in_word == 0
+// and the per-word fields cleared, so boundaries compare with memcmp
+struct arsh_hl_state {
+  unsigned char in_word;
+  unsigned char quote;  // inside "..."
+  unsigned char var;    // inside the name of a $VAR
+  unsigned char arith;  // paren depth inside $((...))
+  unsigned char wparen; // parens opened inside the word, e.g. <(cmd)
+  unsigned char expect_cmd;
+  unsigned char after_redir;
+};
+
+// highlighted line plus a model of what the terminal currently shows
+struct arsh_hl {
+  struct arsh_hl_state *states; // len + 1 entries
+  unsigned char *styles;
+  char *shown;
+  unsigned char *shown_styles;
+  int cap;
+  int len;
+  int shown_len;
+  int cursor; // byte the terminal cursor sits before
+  int prompt_width;
+};
+
+void arsh_hl_begin(struct arsh_hl *hl, int prompt_width);
+void arsh_hl_edit(struct arsh_hl *hl, const char *buf, int len, int pos,
+                  int removed, int inserted);
+void arsh_hl_refresh(struct arsh_hl *hl, const char *buf, int len,
+                     int position);
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdio.h>
+
+int arsh_run_parallel(FILE *stream, int jobs);
+
+#endif
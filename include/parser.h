@@ -4,5 +4,6 @@
 char **arsh_split_line(char *line);
 char **arsh_expand_wildcards(char **args);
 char **arsh_expand_env_vars(char **args);
+int arsh_paren_balance(const char *word);
 
 #endif
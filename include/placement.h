@@ -0,0 +1,10 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+int arsh_is_placement(const char *word);
+char *arsh_placement_command(char **args);
+void arsh_placement_apply(char **args);
+void arsh_placement_pin(const char *word, int stage);
+void arsh_placement_background();
+
+#endif
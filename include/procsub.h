@@ -0,0 +1,9 @@
+#ifndef PROCSUB_H
+#define PROCSUB_H
+
+int arsh_procsub_mark();
+char **arsh_expand_procsubs(char **args);
+void arsh_procsub_prepare_child(char **args);
+void arsh_procsub_finish(int mark, int background);
+
+#endif
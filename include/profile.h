@@ -0,0 +1,24 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "stats.h"
+#include <pthread.h>
+
+// shell-owned copier between two pipeline stages that counts the bytes it
+// moves and how long it sat waiting on either side
+struct arsh_relay {
+  int in_fd;  // read end of the producer's pipe
+  int out_fd; // write end of the consumer's pipe
+  unsigned long long bytes;
+  double read_wait_ms;
+  double write_wait_ms;
+  double life_ms;
+  pthread_t thread;
+};
+
+int arsh_relay_start(struct arsh_relay *relay);
+void arsh_relay_join(struct arsh_relay *relay);
+void arsh_profile_report(char ***stages, struct arsh_proc_stats *stats,
+                         struct arsh_relay *relays, int n);
+
+#endif
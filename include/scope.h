@@ -0,0 +1,10 @@
+#ifndef SCOPE_H
+#define SCOPE_H
+
+void arsh_scope_push(int isolate);
+void arsh_scope_pop();
+int arsh_scope_redirect(char **args);
+void arsh_scope_touch_env();
+void arsh_scope_touch_cwd();
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+#define ARSH_REQ_COMMAND 1 // body is a single command line
+#define ARSH_REQ_SCRIPT 2  // body is the absolute path of a script file
+
+// fixed header sent ahead of the cwd and body, together with the client's
+// stdin/stdout/stderr passed as SCM_RIGHTS
+struct arsh_request_hdr {
+  uint32_t kind;
+  uint32_t cwd_len;
+  uint32_t body_len;
+};
+
+int arsh_server(const char *sock_path);
+int arsh_client(const char *sock_path, int kind, const char *body);
+
+#endif
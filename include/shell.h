@@ -24,6 +24,7 @@
 #define HISTORY_MAX 50
 
 extern volatile sig_atomic_t is_running_command;
+extern volatile sig_atomic_t line_interrupted; // Ctrl+C dropped the line
 extern int last_exit_status;
 extern char *history[HISTORY_MAX];
 extern int history_count;
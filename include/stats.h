@@ -0,0 +1,34 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define ARSH_STATS_NAME_MAX 64
+
+// resource usage of one reaped child
+struct arsh_proc_stats {
+  pid_t pid;
+  char name[ARSH_STATS_NAME_MAX];
+  int status; // raw wait status
+  double wall_ms;
+  double user_ms;
+  double sys_ms;
+  long max_rss_kb;
+  long nvcsw;
+  long nivcsw;
+  long inblock;
+  long oublock;
+};
+
+void arsh_stats_track(pid_t pid, const char *name);
+pid_t arsh_stats_wait(pid_t pid, int *status, int options,
+                      struct arsh_proc_stats *out);
+void arsh_time_begin();
+void arsh_time_end();
+int arsh_time_active();
+void arsh_stats_report(FILE *out);
+void arsh_stats_reset();
+void arsh_json_write_string(FILE *out, const char *s);
+
+#endif
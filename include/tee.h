@@ -0,0 +1,31 @@
+#ifndef TEE_H
+#define TEE_H
+
+#include <pthread.h>
+
+// one destination of a multios command: a > / >> file or the next stage
+struct arsh_tee_target {
+  int fd;
+  int tmp[2]; // private pipe that tee(2) duplicates the stream into
+  char *name;
+  unsigned long long bytes;
+  int copy; // splice refused this fd, fall back to read/write
+  int dead; // write failed, e.g. the next stage exited
+};
+
+// shell-owned relay that copies a command's stdout into every target
+struct arsh_tee {
+  int in_fd;
+  struct arsh_tee_target *targets;
+  int n;
+  int detached; // background job: the thread reports and frees itself
+  int report;   // print bytes per target at the end (time or profile)
+  pthread_t thread;
+};
+
+int arsh_tee_outputs(char **args);
+struct arsh_tee *arsh_tee_setup(char **args, int pipe_fd, int *out_fd);
+int arsh_tee_start(struct arsh_tee *tee, int detached);
+void arsh_tee_finish(struct arsh_tee *tee);
+
+#endif
@@ -0,0 +1,775 @@
+#define _GNU_SOURCE
+
+#include "../include/arith.h"
+#include "../include/parser.h"
+#include "../include/scope.h"
+#include "../include/shell.h"
+#include <errno.h>
+#include <stdint.h>
+
+#define ARSH_ARITH_CACHE_MAX 4096 // compiled expressions kept before a flush
+#define ARSH_ARITH_NAME_MAX 128
+
+// 64-bit integer expressions as in $((...)) and let, with C operators and
+// precedence plus **. Variables are the shell's environment variables.
+
+enum arith_kind {
+  A_NUM,
+  A_VAR,
+  // unary
+  A_NEG,
+  A_POS,
+  A_NOT,
+  A_BNOT,
+  A_PREINC,
+  A_PREDEC,
+  A_POSTINC,
+  A_POSTDEC,
+  // binary
+  A_POW,
+  A_MUL,
+  A_DIV,
+  A_MOD,
+  A_ADD,
+  A_SUB,
+  A_SHL,
+  A_SHR,
+  A_LT,
+  A_LE,
+  A_GT,
+  A_GE,
+  A_EQ,
+  A_NE,
+  A_BAND,
+  A_BXOR,
+  A_BOR,
+  A_AND,
+  A_OR,
+  // other
+  A_COND,
+  A_ASSIGN,
+  A_COMMA
+};
+
+struct arith_node {
+  enum arith_kind kind;
+  int assign_op; // for A_ASSIGN: the binary kind of op=, or -1 for plain =
+  long long value;
+  char *name;
+  struct arith_node *a, *b, *c;
+};
+
+// binary operators by precedence, loosest first
+static const struct {
+  const char *op;
+  enum arith_kind kind;
+  int prec;
+} binops[] = {{"||", A_OR, 1},   {"&&", A_AND, 2},  {"|", A_BOR, 3},
+              {"^", A_BXOR, 4},  {"&", A_BAND, 5},  {"==", A_EQ, 6},
+              {"!=", A_NE, 6},   {"<", A_LT, 7},    {"<=", A_LE, 7},
+              {">", A_GT, 7},    {">=", A_GE, 7},   {"<<", A_SHL, 8},
+              {">>", A_SHR, 8},  {"+", A_ADD, 9},   {"-", A_SUB, 9},
+              {"*", A_MUL, 10},  {"/", A_DIV, 10},  {"%", A_MOD, 10},
+              {"**", A_POW, 11}};
+
+#define ARSH_ARITH_POW_PREC 11
+
+// every operator token, longest spellings first so the lexer is greedy
+static const char *operators[] = {
+    "<<=", ">>=", "**", "++", "--", "<<", ">>", "<=", ">=", "==", "!=",
+    "&&",  "||",  "*=", "/=", "%=", "+=", "-=", "&=", "^=", "|=", "+",
+    "-",   "*",   "/",  "%",  "<",  ">",  "&",  "^",  "|",  "!",  "~",
+    "=",   "?",   ":",  ",",  "(",  ")"};
+
+enum token_type { T_END, T_NUM, T_NAME, T_OP, T_ERROR };
+
+struct parser {
+  const char *src;
+  const char *p;
+  const char *tok; // start of the current token
+  enum token_type type;
+  long long num;
+  char name[ARSH_ARITH_NAME_MAX];
+  const char *op;
+};
+
+static struct arith_node *new_node(enum arith_kind kind) {
+  struct arith_node *n = calloc(1, sizeof(*n));
+  if (!n) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  n->kind = kind;
+  n->assign_op = -1;
+  return n;
+}
+
+static void free_node(struct arith_node *n) {
+  if (n == NULL)
+    return;
+  free_node(n->a);
+  free_node(n->b);
+  free_node(n->c);
+  free(n->name);
+  free(n);
+}
+
+static void next_token(struct parser *ps) {
+  while (isspace((unsigned char)*ps->p))
+    ps->p++;
+
+  const char *p = ps->p;
+  ps->tok = p;
+  if (*p == '\0') {
+    ps->type = T_END;
+    return;
+  }
+
+  if (isdigit((unsigned char)*p)) {
+    char *end;
+    errno = 0;
+    ps->num = strtoll(p, &end, 0);
+    if (errno != 0 || isalnum((unsigned char)*end) || *end == '_') {
+      ps->type = T_ERROR;
+      return;
+    }
+    ps->type = T_NUM;
+    ps->p = end;
+    return;
+  }
+
+  // $name is accepted as well as name
+  if (*p == '$' && (isalpha((unsigned char)p[1]) || p[1] == '_'))
+    p++;
+  if (isalpha((unsigned char)*p) || *p == '_') {
+    size_t len = 0;
+    while (isalnum((unsigned char)p[len]) || p[len] == '_')
+      len++;
+    if (len >= sizeof(ps->name)) {
+      ps->type = T_ERROR;
+      return;
+    }
+    memcpy(ps->name, p, len);
+    ps->name[len] = '\0';
+    ps->type = T_NAME;
+    ps->p = p + len;
+    return;
+  }
+
+  for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+    size_t len = strlen(operators[i]);
+    if (strncmp(p, operators[i], len) == 0) {
+      ps->type = T_OP;
+      ps->op = operators[i];
+      ps->p = p + len;
+      return;
+    }
+  }
+  ps->type = T_ERROR;
+}
+
+static int is_op(struct parser *ps, const char *op) {
+  return ps->type == T_OP && strcmp(ps->op, op) == 0;
+}
+
+static struct arith_node *parse_error(struct parser *ps) {
+  if (ps->type == T_END)
+    fprintf(stderr, "arsh: %s: unexpected end of expression\n", ps->src);
+  else
+    fprintf(stderr, "arsh: %s: syntax error near \"%s\"\n", ps->src,
+            ps->tok);
+  return NULL;
+}
+
+static struct arith_node *parse_comma(struct parser *ps);
+static struct arith_node *parse_assign(struct parser *ps);
+static struct arith_node *parse_unary(struct parser *ps);
+
+static struct arith_node *parse_primary(struct parser *ps) {
+  struct arith_node *n;
+
+  if (ps->type == T_NUM) {
+    n = new_node(A_NUM);
+    n->value = ps->num;
+    next_token(ps);
+  } else if (ps->type == T_NAME) {
+    n = new_node(A_VAR);
+    n->name = strdup(ps->name);
+    next_token(ps);
+  } else if (is_op(ps, "(")) {
+    next_token(ps);
+    n = parse_comma(ps);
+    if (n == NULL)
+      return NULL;
+    if (!is_op(ps, ")")) {
+      free_node(n);
+      return parse_error(ps);
+    }
+    next_token(ps);
+  } else {
+    return parse_error(ps);
+  }
+
+  if (n->kind == A_VAR && (is_op(ps, "++") || is_op(ps, "--"))) {
+    struct arith_node *post = new_node(is_op(ps, "++") ? A_POSTINC : A_POSTDEC);
+    post->a = n;
+    next_token(ps);
+    return post;
+  }
+  return n;
+}
+
+static struct arith_node *parse_unary(struct parser *ps) {
+  static const struct {
+    const char *op;
+    enum arith_kind kind;
+  } unops[] = {{"-", A_NEG},     {"+", A_POS},     {"!", A_NOT},
+               {"~", A_BNOT},    {"++", A_PREINC}, {"--", A_PREDEC}};
+
+  for (size_t i = 0; i < sizeof(unops) / sizeof(unops[0]); i++) {
+    if (!is_op(ps, unops[i].op))
+      continue;
+
+    next_token(ps);
+    struct arith_node *operand = parse_unary(ps);
+    if (operand == NULL)
+      return NULL;
+    if ((unops[i].kind == A_PREINC || unops[i].kind == A_PREDEC) &&
+        operand->kind != A_VAR) {
+      fprintf(stderr, "arsh: %s: %s needs a variable\n", ps->src, unops[i].op);
+      free_node(operand);
+      return NULL;
+    }
+
+    struct arith_node *n = new_node(unops[i].kind);
+    n->a = operand;
+    return n;
+  }
+  return parse_primary(ps);
+}
+
+// precedence climbing over binops[]; ** is the only right-associative one
+static struct arith_node *parse_binary(struct parser *ps, int min_prec) {
+  struct arith_node *lhs = parse_unary(ps);
+
+  while (lhs != NULL && ps->type == T_OP) {
+    int found = -1;
+    for (size_t i = 0; i < sizeof(binops) / sizeof(binops[0]); i++) {
+      if (strcmp(ps->op, binops[i].op) == 0 && binops[i].prec >= min_prec) {
+        found = i;
+        break;
+      }
+    }
+    if (found == -1)
+      break;
+
+    next_token(ps);
+    int prec = binops[found].prec;
+    struct arith_node *rhs =
+        parse_binary(ps, prec == ARSH_ARITH_POW_PREC ? prec : prec + 1);
+    if (rhs == NULL) {
+      free_node(lhs);
+      return NULL;
+    }
+
+    struct arith_node *n = new_node(binops[found].kind);
+    n->a = lhs;
+    n->b = rhs;
+    lhs = n;
+  }
+  return lhs;
+}
+
+static struct arith_node *parse_cond(struct parser *ps) {
+  struct arith_node *cond = parse_binary(ps, 1);
+  if (cond == NULL || !is_op(ps, "?"))
+    return cond;
+
+  next_token(ps);
+  struct arith_node *yes = parse_assign(ps);
+  if (yes == NULL) {
+    free_node(cond);
+    return NULL;
+  }
+  if (!is_op(ps, ":")) {
+    free_node(cond);
+    free_node(yes);
+    return parse_error(ps);
+  }
+
+  next_token(ps);
+  struct arith_node *no = parse_cond(ps);
+  if (no == NULL) {
+    free_node(cond);
+    free_node(yes);
+    return NULL;
+  }
+
+  struct arith_node *n = new_node(A_COND);
+  n->a = cond;
+  n->b = yes;
+  n->c = no;
+  return n;
+}
+
+static struct arith_node *parse_assign(struct parser *ps) {
+  struct arith_node *lhs = parse_cond(ps);
+  if (lhs == NULL || ps->type != T_OP)
+    return lhs;
+
+  size_t len = strlen(ps->op);
+  if (ps->op[len - 1] != '=' || strcmp(ps->op, "==") == 0 ||
+      strcmp(ps->op, "!=") == 0 || strcmp(ps->op, "<=") == 0 ||
+      strcmp(ps->op, ">=") == 0)
+    return lhs;
+
+  if (lhs->kind != A_VAR) {
+    fprintf(stderr, "arsh: %s: can only assign to a variable\n", ps->src);
+    free_node(lhs);
+    return NULL;
+  }
+
+  struct arith_node *n = new_node(A_ASSIGN);
+  if (len > 1) {
+    // op= reuses the binary operator spelled before the '='
+    for (size_t i = 0; i < sizeof(binops) / sizeof(binops[0]); i++) {
+      if (strlen(binops[i].op) == len - 1 &&
+          strncmp(binops[i].op, ps->op, len - 1) == 0)
+        n->assign_op = binops[i].kind;
+    }
+  }
+
+  next_token(ps);
+  n->a = lhs;
+  n->b = parse_assign(ps);
+  if (n->b == NULL) {
+    free_node(n);
+    return NULL;
+  }
+  return n;
+}
+
+static struct arith_node *parse_comma(struct parser *ps) {
+  struct arith_node *lhs = parse_assign(ps);
+
+  while (lhs != NULL && is_op(ps, ",")) {
+    next_token(ps);
+    struct arith_node *rhs = parse_assign(ps);
+    if (rhs == NULL) {
+      free_node(lhs);
+      return NULL;
+    }
+    struct arith_node *n = new_node(A_COMMA);
+    n->a = lhs;
+    n->b = rhs;
+    lhs = n;
+  }
+  return lhs;
+}
+
+static struct arith_node *compile(const char *src) {
+  struct parser ps = {.src = src, .p = src};
+  next_token(&ps);
+  if (ps.type == T_END) {
+    // an empty expression is 0, as in $(( ))
+    return new_node(A_NUM);
+  }
+
+  struct arith_node *n = parse_comma(&ps);
+  if (n != NULL && ps.type != T_END) {
+    free_node(n);
+    return parse_error(&ps);
+  }
+  return n;
+}
+
+// Compiled expressions keyed by their source text. Arithmetic runs before
+// $VAR expansion, so a loop body's expression text stays the same on every
+// iteration and is parsed once.
+struct cache_entry {
+  char *src;
+  struct arith_node *ast;
+};
+
+static struct cache_entry *cache = NULL;
+static size_t cache_cap = 0;
+static size_t cache_count = 0;
+
+static uint32_t hash_src(const char *s) {
+  uint32_t h = 2166136261u;
+  for (; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void cache_clear() {
+  for (size_t i = 0; i < cache_cap; i++) {
+    if (cache[i].src != NULL) {
+      free(cache[i].src);
+      free_node(cache[i].ast);
+      cache[i].src = NULL;
+    }
+  }
+  cache_count = 0;
+}
+
+static struct arith_node *cache_lookup(const char *src) {
+  if (cache_cap == 0) {
+    cache_cap = 64;
+    cache = calloc(cache_cap, sizeof(*cache));
+    if (!cache) {
+      fprintf(stderr, "arsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  size_t i = hash_src(src) & (cache_cap - 1);
+  for (; cache[i].src != NULL; i = (i + 1) & (cache_cap - 1)) {
+    if (strcmp(cache[i].src, src) == 0)
+      return cache[i].ast;
+  }
+
+  struct arith_node *ast = compile(src);
+  if (ast == NULL)
+    return NULL;
+
+  if (cache_count >= ARSH_ARITH_CACHE_MAX) {
+    cache_clear();
+    i = hash_src(src) & (cache_cap - 1);
+  } else if ((cache_count + 1) * 4 > cache_cap * 3) {
+    // keep the table at most 3/4 full
+    struct cache_entry *old = cache;
+    size_t old_cap = cache_cap;
+    cache_cap *= 2;
+    cache = calloc(cache_cap, sizeof(*cache));
+    if (!cache) {
+      fprintf(stderr, "arsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t k = 0; k < old_cap; k++) {
+      if (old[k].src == NULL)
+        continue;
+      size_t j = hash_src(old[k].src) & (cache_cap - 1);
+      while (cache[j].src != NULL)
+        j = (j + 1) & (cache_cap - 1);
+      cache[j] = old[k];
+    }
+    free(old);
+    i = hash_src(src) & (cache_cap - 1);
+  }
+  while (cache[i].src != NULL)
+    i = (i + 1) & (cache_cap - 1);
+
+  cache[i].src = strdup(src);
+  cache[i].ast = ast;
+  cache_count++;
+  return ast;
+}
+
+static int get_var(const char *src, const char *name, long long *out) {
+  char *value = getenv(name);
+  if (value == NULL || value[0] == '\0') {
+    *out = 0;
+    return 0;
+  }
+
+  char *end;
+  errno = 0;
+  *out = strtoll(value, &end, 0);
+  while (isspace((unsigned char)*end))
+    end++;
+  if (errno != 0 || *end != '\0') {
+    fprintf(stderr, "arsh: %s: %s is not a number: \"%s\"\n", src, name,
+            value);
+    return -1;
+  }
+  return 0;
+}
+
+static void set_var(const char *name, long long value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%lld", value);
+  arsh_scope_touch_env();
+  if (setenv(name, buf, 1) != 0)
+    perror("arsh");
+}
+
+// wrap-around arithmetic without signed-overflow UB
+static long long binary(const char *src, enum arith_kind kind, long long x,
+                        long long y, int *err) {
+  unsigned long long ux = x, uy = y;
+
+  switch (kind) {
+  case A_ADD:
+    return (long long)(ux + uy);
+  case A_SUB:
+    return (long long)(ux - uy);
+  case A_MUL:
+    return (long long)(ux * uy);
+  case A_DIV:
+  case A_MOD:
+    if (y == 0) {
+      fprintf(stderr, "arsh: %s: division by zero\n", src);
+      *err = 1;
+      return 0;
+    }
+    if (x == INT64_MIN && y == -1)
+      return kind == A_DIV ? x : 0;
+    return kind == A_DIV ? x / y : x % y;
+  case A_POW: {
+    if (y < 0) {
+      fprintf(stderr, "arsh: %s: negative exponent\n", src);
+      *err = 1;
+      return 0;
+    }
+    unsigned long long result = 1;
+    for (; uy > 0; uy >>= 1) {
+      if (uy & 1)
+        result *= ux;
+      ux *= ux;
+    }
+    return (long long)result;
+  }
+  case A_SHL:
+    return (long long)(ux << (uy & 63));
+  case A_SHR:
+    return x >> (uy & 63);
+  case A_LT:
+    return x < y;
+  case A_LE:
+    return x <= y;
+  case A_GT:
+    return x > y;
+  case A_GE:
+    return x >= y;
+  case A_EQ:
+    return x == y;
+  case A_NE:
+    return x != y;
+  case A_BAND:
+    return x & y;
+  case A_BXOR:
+    return x ^ y;
+  case A_BOR:
+    return x | y;
+  default:
+    *err = 1;
+    return 0;
+  }
+}
+
+static int eval(const char *src, struct arith_node *n, long long *out) {
+  long long x, y;
+  int err = 0;
+
+  switch (n->kind) {
+  case A_NUM:
+    *out = n->value;
+    return 0;
+  case A_VAR:
+    return get_var(src, n->name, out);
+  case A_NEG:
+  case A_POS:
+  case A_NOT:
+  case A_BNOT:
+    if (eval(src, n->a, &x))
+      return -1;
+    *out = n->kind == A_NEG   ? (long long)(0ULL - (unsigned long long)x)
+           : n->kind == A_POS ? x
+           : n->kind == A_NOT ? !x
+                              : ~x;
+    return 0;
+  case A_PREINC:
+  case A_PREDEC:
+  case A_POSTINC:
+  case A_POSTDEC: {
+    if (get_var(src, n->a->name, &x))
+      return -1;
+    int inc = n->kind == A_PREINC || n->kind == A_POSTINC;
+    y = (long long)((unsigned long long)x + (inc ? 1 : -1ULL));
+    set_var(n->a->name, y);
+    *out = n->kind == A_PREINC || n->kind == A_PREDEC ? y : x;
+    return 0;
+  }
+  case A_AND:
+  case A_OR:
+    if (eval(src, n->a, &x))
+      return -1;
+    if ((n->kind == A_AND && !x) || (n->kind == A_OR && x)) {
+      *out = n->kind == A_OR;
+      return 0;
+    }
+    if (eval(src, n->b, &y))
+      return -1;
+    *out = y != 0;
+    return 0;
+  case A_COND:
+    if (eval(src, n->a, &x))
+      return -1;
+    return eval(src, x ? n->b : n->c, out);
+  case A_ASSIGN:
+    if (eval(src, n->b, &y))
+      return -1;
+    if (n->assign_op != -1) {
+      if (get_var(src, n->a->name, &x))
+        return -1;
+      y = binary(src, n->assign_op, x, y, &err);
+      if (err)
+        return -1;
+    }
+    set_var(n->a->name, y);
+    *out = y;
+    return 0;
+  case A_COMMA:
+    if (eval(src, n->a, &x))
+      return -1;
+    return eval(src, n->b, out);
+  default:
+    if (eval(src, n->a, &x) || eval(src, n->b, &y))
+      return -1;
+    *out = binary(src, n->kind, x, y, &err);
+    return err ? -1 : 0;
+  }
+}
+
+// evaluate expr, compiling it on first use. Returns -1 after reporting a
+// syntax or evaluation error.
+int arsh_arith_eval(const char *expr, long long *result) {
+  struct arith_node *ast = cache_lookup(expr);
+  if (ast == NULL)
+    return -1;
+  return eval(expr, ast, result);
+}
+
+// replace each $((expr)) in word with its value; NULL on error
+static char *expand_word(const char *word) {
+  size_t cap = strlen(word) + 32, len = 0;
+  char *out = malloc(cap);
+  if (!out) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  const char *p = word;
+  const char *start;
+  while ((start = strstr(p, "$((")) != NULL) {
+    // the expression ends at the "))" that balances the opening "(("
+    const char *expr = start + 3;
+    const char *end = expr;
+    int depth = 0;
+    while (*end && !(depth == 0 && end[0] == ')' && end[1] == ')')) {
+      if (*end == '(')
+        depth++;
+      else if (*end == ')')
+        depth--;
+      end++;
+    }
+    if (*end == '\0') {
+      fprintf(stderr, "arsh: unterminated $((\n");
+      free(out);
+      return NULL;
+    }
+
+    char *src = strndup(expr, end - expr);
+    long long value;
+    int failed = !src || arsh_arith_eval(src, &value) == -1;
+    free(src);
+    if (failed) {
+      free(out);
+      return NULL;
+    }
+
+    char num[32];
+    int n = snprintf(num, sizeof(num), "%lld", value);
+    size_t need = len + (start - p) + n + strlen(end + 2) + 1;
+    if (need > cap) {
+      cap = need * 2;
+      out = realloc(out, cap);
+      if (!out) {
+        fprintf(stderr, "arsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    memcpy(out + len, p, start - p);
+    len += start - p;
+    memcpy(out + len, num, n);
+    len += n;
+    p = end + 2;
+  }
+
+  size_t rest = strlen(p);
+  if (len + rest + 1 > cap) {
+    cap = len + rest + 1;
+    out = realloc(out, cap);
+    if (!out) {
+      fprintf(stderr, "arsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(out + len, p, rest + 1);
+  return out;
+}
+
+// Expand $((...)) before $VAR expansion so the expression sees variable
+// names rather than their values. An expression may span several tokens
+// when it contains spaces; they are joined back together first.
+// Returns NULL, after reporting, if any expression fails.
+char **arsh_expand_arith(char **args) {
+  int bufsize = 64;
+  int position = 0;
+  char **tokens = malloc(bufsize * sizeof(char *));
+
+  if (!tokens) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; args[i] != NULL; i++) {
+    char *start = strstr(args[i], "$((");
+    if (start == NULL) {
+      tokens[position++] = strdup(args[i]);
+    } else {
+      size_t len = strlen(args[i]);
+      char *word = strdup(args[i]);
+      int depth = arsh_paren_balance(start);
+      while (word && depth > 0 && args[i + 1] != NULL) {
+        i++;
+        len += strlen(args[i]) + 1;
+        word = realloc(word, len + 1);
+        if (word) {
+          strcat(word, " ");
+          strcat(word, args[i]);
+        }
+        depth += arsh_paren_balance(args[i]);
+      }
+      if (!word) {
+        fprintf(stderr, "arsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+
+      char *expanded = expand_word(word);
+      free(word);
+      if (expanded == NULL) {
+        for (int k = 0; k < position; k++)
+          free(tokens[k]);
+        free(tokens);
+        return NULL;
+      }
+      tokens[position++] = expanded;
+    }
+
+    if (position >= bufsize) {
+      bufsize *= 2;
+      tokens = realloc(tokens, bufsize * sizeof(char *));
+      if (!tokens) {
+        fprintf(stderr, "arsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  tokens[position] = NULL;
+  return tokens;
+}
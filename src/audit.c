@@ -0,0 +1,397 @@
+#define _GNU_SOURCE
+
+#include "../include/audit.h"
+#include "../include/shell.h"
+#include <errno.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define ARSH_AUDIT_SLOTS 256 // must be a power of two
+#define ARSH_AUDIT_SLOT_SIZE 8192
+#define ARSH_AUDIT_BATCH 64
+#define ARSH_AUDIT_KEEP 5 // rotated files kept as path.1 .. path.5
+#define ARSH_AUDIT_DEFAULT_MAX_BYTES (10L * 1024 * 1024)
+#define ARSH_AUDIT_POLL_MIN_NS (1000000L) // right after a busy spell
+#define ARSH_AUDIT_POLL_MAX_NS (50 * 1000000L)
+
+// one formatted JSON line waiting for the writer
+struct audit_slot {
+  size_t len;
+  char data[ARSH_AUDIT_SLOT_SIZE];
+};
+
+// Single-producer/single-consumer ring: only the shell's main thread
+// advances head and only the writer thread advances tail, so neither side
+// ever takes a lock or makes a syscall on behalf of the other.
+static struct audit_slot *ring = NULL;
+static atomic_size_t head;
+static atomic_size_t tail;
+static atomic_ulong dropped;
+static atomic_int stopping;
+
+static int enabled = 0;
+static pid_t owner = 0;
+static int hooks_installed = 0;
+static pthread_t writer;
+
+static char *log_path = NULL;
+static long max_bytes;
+static int log_fd = -1;
+static long log_size;
+static char user[64];
+static char cwd[PATH_MAX] = "?"; // refreshed on cd, not per command
+
+// append s to buf[*len] as a JSON string, leaving room for reserve more
+// bytes. Returns -1, with *len unchanged, if it doesn't fit.
+static int json_append(char *buf, size_t *len, size_t cap, size_t reserve,
+                       const char *s) {
+  size_t pos = *len;
+  if (pos + 1 + reserve >= cap)
+    return -1;
+  buf[pos++] = '"';
+
+  for (; *s; s++) {
+    unsigned char c = (unsigned char)*s;
+    char esc[8];
+    int n;
+    if (c == '"' || c == '\\')
+      n = snprintf(esc, sizeof(esc), "\\%c", c);
+    else if (c == '\n')
+      n = snprintf(esc, sizeof(esc), "\\n");
+    else if (c == '\t')
+      n = snprintf(esc, sizeof(esc), "\\t");
+    else if (c < 0x20)
+      n = snprintf(esc, sizeof(esc), "\\u%04x", c);
+    else {
+      esc[0] = c;
+      n = 1;
+    }
+
+    if (pos + n + 1 + reserve >= cap)
+      return -1;
+    memcpy(buf + pos, esc, n);
+    pos += n;
+  }
+
+  buf[pos++] = '"';
+  buf[pos] = '\0';
+  *len = pos;
+  return 0;
+}
+
+static int open_log() {
+  log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (log_fd == -1) {
+    perror("arsh: audit log");
+    return -1;
+  }
+
+  struct stat st;
+  log_size = fstat(log_fd, &st) == 0 ? st.st_size : 0;
+  return 0;
+}
+
+// shift path.N up by one and start a fresh file. Another arsh process
+// appending to the same log may have rotated it already, in which case
+// only reopen.
+static void rotate_log() {
+  struct stat ours, current;
+  int rotated = fstat(log_fd, &ours) == 0 && stat(log_path, &current) == 0 &&
+                (ours.st_dev != current.st_dev || ours.st_ino != current.st_ino);
+
+  if (!rotated) {
+    size_t n = strlen(log_path) + 16;
+    char *from = malloc(n);
+    char *to = malloc(n);
+    if (!from || !to) {
+      fprintf(stderr, "arsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = ARSH_AUDIT_KEEP - 1; i >= 1; i--) {
+      snprintf(from, n, "%s.%d", log_path, i);
+      snprintf(to, n, "%s.%d", log_path, i + 1);
+      rename(from, to);
+    }
+    snprintf(to, n, "%s.1", log_path);
+    if (rename(log_path, to) != 0 && errno != ENOENT)
+      perror("arsh: audit log rotate");
+
+    free(from);
+    free(to);
+  }
+
+  close(log_fd);
+  open_log();
+}
+
+static void write_all(struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t n = writev(log_fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("arsh: audit log");
+      return;
+    }
+
+    log_size += n;
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+// write slots [from, to) in batches, rotating between batches
+static void drain(size_t from, size_t to) {
+  struct iovec iov[ARSH_AUDIT_BATCH];
+
+  while (from != to) {
+    if (log_fd != -1 && log_size >= max_bytes)
+      rotate_log();
+
+    int count = 0;
+    long batch_bytes = 0;
+    while (from != to && count < ARSH_AUDIT_BATCH) {
+      struct audit_slot *s = &ring[from & (ARSH_AUDIT_SLOTS - 1)];
+      if (count > 0 && log_size + batch_bytes + (long)s->len > max_bytes)
+        break;
+      iov[count].iov_base = s->data;
+      iov[count].iov_len = s->len;
+      batch_bytes += s->len;
+      count++;
+      from++;
+    }
+
+    if (log_fd != -1)
+      write_all(iov, count);
+    atomic_store_explicit(&tail, from, memory_order_release);
+  }
+}
+
+static void report_drops(unsigned long *reported) {
+  unsigned long total = atomic_load_explicit(&dropped, memory_order_relaxed);
+  if (total == *reported || log_fd == -1)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  char line[128];
+  int n = snprintf(line, sizeof(line), "{\"ts\":%ld.%03ld,\"dropped\":%lu}\n",
+                   (long)now.tv_sec, now.tv_nsec / 1000000, total - *reported);
+  struct iovec iov = {.iov_base = line, .iov_len = n};
+  write_all(&iov, 1);
+  *reported = total;
+}
+
+static void *writer_main(void *arg) {
+  (void)arg;
+  unsigned long reported = 0;
+  long poll_ns = ARSH_AUDIT_POLL_MIN_NS;
+
+  // the shell never wakes the writer, so it polls: quickly while commands
+  // keep arriving, backing off while the shell is idle
+  while (1) {
+    // read stopping before head: once it is set no more records arrive
+    int stop = atomic_load_explicit(&stopping, memory_order_acquire);
+    size_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+    size_t h = atomic_load_explicit(&head, memory_order_acquire);
+
+    if (h != t) {
+      drain(t, h);
+      poll_ns = ARSH_AUDIT_POLL_MIN_NS;
+      continue;
+    }
+
+    report_drops(&reported);
+    if (stop)
+      break;
+
+    struct timespec idle = {.tv_sec = 0, .tv_nsec = poll_ns};
+    nanosleep(&idle, NULL);
+    if (poll_ns < ARSH_AUDIT_POLL_MAX_NS)
+      poll_ns *= 2;
+  }
+  return NULL;
+}
+
+static void flush_at_exit() { arsh_audit_flush(); }
+
+// the writer thread does not survive fork(); forked children stop recording
+// unless they call arsh_audit_init() again, as every child that goes on to
+// run shell code (groups, process substitutions, parallel tasks) does
+static void disable_in_child() {
+  enabled = 0;
+  if (log_fd != -1) {
+    close(log_fd);
+    log_fd = -1;
+  }
+}
+
+// start recording to $ARSH_AUDIT_LOG, rotating at $ARSH_AUDIT_MAX_BYTES.
+// Safe to call again in a forked child to give it a writer of its own.
+void arsh_audit_init() {
+  char *path = getenv("ARSH_AUDIT_LOG");
+  if (path == NULL || path[0] == '\0')
+    return;
+  if (enabled && owner == getpid())
+    return;
+
+  free(log_path);
+  log_path = strdup(path);
+  if (!log_path) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char *limit = getenv("ARSH_AUDIT_MAX_BYTES");
+  max_bytes = limit ? strtol(limit, NULL, 10) : 0;
+  if (max_bytes <= 0)
+    max_bytes = ARSH_AUDIT_DEFAULT_MAX_BYTES;
+
+  arsh_audit_set_cwd(NULL);
+
+  struct passwd *pw = getpwuid(geteuid());
+  if (pw != NULL)
+    snprintf(user, sizeof(user), "%s", pw->pw_name);
+  else
+    snprintf(user, sizeof(user), "%d", (int)geteuid());
+
+  if (ring == NULL) {
+    ring = malloc(ARSH_AUDIT_SLOTS * sizeof(struct audit_slot));
+    if (!ring) {
+      fprintf(stderr, "arsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  atomic_store(&head, 0);
+  atomic_store(&tail, 0);
+  atomic_store(&dropped, 0);
+  atomic_store(&stopping, 0);
+
+  if (open_log() == -1)
+    return;
+
+  // signals belong to the shell's main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&writer, NULL, writer_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0) {
+    fprintf(stderr, "arsh: audit writer: %s\n", strerror(err));
+    close(log_fd);
+    log_fd = -1;
+    return;
+  }
+
+  enabled = 1;
+  owner = getpid();
+  if (!hooks_installed) {
+    atexit(flush_at_exit);
+    pthread_atfork(NULL, NULL, disable_in_child);
+    hooks_installed = 1;
+  }
+}
+
+void arsh_audit_begin(struct arsh_audit_cmd *cmd, char **args) {
+  cmd->active = enabled;
+  if (!enabled)
+    return;
+
+  clock_gettime(CLOCK_REALTIME, &cmd->wall);
+  clock_gettime(CLOCK_MONOTONIC, &cmd->start);
+
+  // the builtins edit their arguments in place, so encode argv up front
+  size_t len = 0;
+  cmd->argv[len++] = '[';
+  cmd->truncated = 0;
+  for (int i = 0; args[i] != NULL; i++) {
+    size_t before = len;
+    if (i > 0)
+      cmd->argv[len++] = ',';
+    if (json_append(cmd->argv, &len, sizeof(cmd->argv), 1, args[i]) == -1) {
+      len = before;
+      cmd->truncated = 1;
+      break;
+    }
+  }
+  cmd->argv[len++] = ']';
+  cmd->argv[len] = '\0';
+}
+
+// remember the working directory for the records that follow; NULL reads
+// it back with getcwd(). Called wherever the shell changes directory so
+// arsh_audit_end() needs no syscall for it.
+void arsh_audit_set_cwd(const char *dir) {
+  if (dir != NULL)
+    snprintf(cwd, sizeof(cwd), "%s", dir);
+  else if (getcwd(cwd, sizeof(cwd)) == NULL)
+    snprintf(cwd, sizeof(cwd), "?");
+}
+
+// format the finished command into the next free slot. Never blocks: when
+// the writer has fallen behind the record is dropped and counted instead.
+void arsh_audit_end(struct arsh_audit_cmd *cmd, int status) {
+  if (!cmd->active || !enabled)
+    return;
+
+  size_t h = atomic_load_explicit(&head, memory_order_relaxed);
+  size_t t = atomic_load_explicit(&tail, memory_order_acquire);
+  if (h - t >= ARSH_AUDIT_SLOTS) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double duration_ms = (now.tv_sec - cmd->start.tv_sec) * 1000.0 +
+                       (now.tv_nsec - cmd->start.tv_nsec) / 1e6;
+
+  struct audit_slot *s = &ring[h & (ARSH_AUDIT_SLOTS - 1)];
+  size_t cap = sizeof(s->data);
+  size_t len = snprintf(s->data, cap, "{\"ts\":%ld.%03ld,\"user\":",
+                        (long)cmd->wall.tv_sec, cmd->wall.tv_nsec / 1000000);
+  json_append(s->data, &len, cap, 0, user);
+  len += snprintf(s->data + len, cap - len, ",\"cwd\":");
+  if (json_append(s->data, &len, cap, strlen(cmd->argv) + 128, cwd) == -1)
+    len += snprintf(s->data + len, cap - len, "null");
+
+  int n = snprintf(s->data + len, cap - len,
+                   ",\"argv\":%s,%s\"duration_ms\":%.3f,\"status\":%d}\n",
+                   cmd->argv, cmd->truncated ? "\"argv_truncated\":true," : "",
+                   duration_ms, status);
+  if (n < 0 || (size_t)n >= cap - len) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+  s->len = len + n;
+
+  atomic_store_explicit(&head, h + 1, memory_order_release);
+}
+
+// stop the writer after it has drained every queued record. Only the
+// process that started the writer may do this.
+void arsh_audit_flush() {
+  if (!enabled || owner != getpid())
+    return;
+  enabled = 0;
+
+  atomic_store_explicit(&stopping, 1, memory_order_release);
+  pthread_join(writer, NULL);
+
+  if (log_fd != -1) {
+    close(log_fd);
+    log_fd = -1;
+  }
+}
@@ -0,0 +1,475 @@
+#include "../include/batch.h"
+#include "../include/executor.h"
+#include "../include/placement.h"
+#include "../include/procsub.h"
+#include "../include/shell.h"
+#include "../include/stats.h"
+
+extern char **environ;
+
+// room left for the kernel's own bookkeeping, as xargs does
+#define ARSH_ARG_HEADROOM 4096
+
+// commands that are split automatically when their argv is too large.
+// Every batch repeats the options and then fixed_operands operands (e.g.
+// chmod's mode), so the options have to be known exactly: short ones in
+// getopt(3) form, plus the long ones that take the next word as a value.
+// An option in `replaces` supplies the fixed operand itself (grep -e PAT),
+// and when `needs` is set one of those options must be present before the
+// command is split without being asked to.
+static const struct {
+  const char *name;
+  int fixed_operands;
+  const char *opts;
+  const char *long_args;
+  const char *replaces;
+  const char *needs;
+} batch_allowlist[] = {
+    {"rm", 0, "fiIrRdv", "", "", ""},
+    {"rmdir", 0, "pv", "", "", ""},
+    {"touch", 0, "acd:fhmr:t:", "date,reference,time", "", ""},
+    {"chmod", 1, "cfvR", "reference", "reference", ""},
+    {"chown", 1, "cfvhRHLP", "from,reference", "reference", ""},
+    {"chgrp", 1, "cfvhRHLP", "reference", "reference", ""},
+    {"gzip", 0, "cdfhklLnNqrS:tvV123456789", "suffix", "", ""},
+    {"gunzip", 0, "cfhklLnNqrS:tvV", "suffix", "", ""},
+    {"bzip2", 0, "dzkftcqvsLV123456789", "", "", ""},
+    {"xz", 0, "zdtlkfceT:qvhHVF:C:M:S:0123456789",
+     "suffix,format,check,threads,memlimit,memlimit-compress,"
+     "memlimit-decompress,memory,block-size,block-list",
+     "", ""},
+    {"zstd", 0, "dzfkcqvt0123456789D:T:B:", "memory,patch-from,format", "",
+     ""},
+    {"cat", 0, "AbeEnstTuv", "", "", ""},
+    // with a single file in a batch grep would stop printing file names
+    {"grep", 1, "EFGPe:f:iyvwxclLm:obqsnhHTZzA:B:C:UVrRaID:d:0123456789",
+     "regexp,file,max-count,label,after-context,before-context,context,"
+     "binary-files,devices,directories,exclude,exclude-from,exclude-dir,"
+     "include,group-separator",
+     "e,f,regexp,file", "H,h,with-filename,no-filename"},
+    {"file", 0, "bcEhikLNprsvzZ0e:F:f:m:P:",
+     "exclude,separator,files-from,magic-file,parameter,exclude-quiet", "",
+     ""},
+    {"md5sum", 0, "bctzw", "", "", ""},
+    {"sha1sum", 0, "bctzw", "", "", ""},
+    {"sha256sum", 0, "bctzw", "", "", ""},
+    {"stat", 0, "Lfc:t", "format,printf", "", ""},
+};
+
+static int allowlist_lookup(const char *cmd) {
+  const char *base = strrchr(cmd, '/');
+  base = base ? base + 1 : cmd;
+
+  int n = sizeof(batch_allowlist) / sizeof(batch_allowlist[0]);
+  for (int i = 0; i < n; i++) {
+    if (strcmp(base, batch_allowlist[i].name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// is the option name (len bytes, a letter or a long name) in the
+// comma-separated list? With prefix set, an abbreviation counts too, as
+// getopt_long(3) accepts one.
+static int in_list(const char *list, const char *name, size_t len,
+                   int prefix) {
+  while (*list) {
+    size_t n = strcspn(list, ",");
+    if ((n == len || (prefix && len < n)) && strncmp(list, name, len) == 0)
+      return 1;
+    list += n;
+    if (*list == ',')
+      list++;
+  }
+  return 0;
+}
+
+// Where the operands that get spread over batches start in words (after
+// the command at index cmd), or -1 if that cannot be told: an option the
+// allowlist does not know, which may take a value, or an option after the
+// operands, which GNU tools would apply to every file. *needed is set when
+// one of the entry's `needs` options is present.
+static int operands_start(char **words, int nwords, int cmd, int *needed) {
+  int entry = allowlist_lookup(words[cmd]);
+  int fixed = entry >= 0 ? batch_allowlist[entry].fixed_operands : 0;
+  int i = cmd + 1;
+  *needed = 0;
+
+  // commands run with "batch" that we know nothing about: every leading
+  // -word is an option and there are no fixed operands
+  if (entry < 0) {
+    while (i < nwords && words[i][0] == '-') {
+      if (strcmp(words[i++], "--") == 0)
+        break;
+    }
+    return i;
+  }
+
+  int ended = 0;
+  for (; i < nwords && words[i][0] == '-' && words[i][1] != '\0'; i++) {
+    const char *word = words[i];
+    if (strcmp(word, "--") == 0) {
+      ended = 1;
+      i++;
+      break;
+    }
+
+    if (word[1] == '-') {
+      // --name, --name=value or --name value
+      const char *name = word + 2;
+      size_t len = strcspn(name, "=");
+      if (in_list(batch_allowlist[entry].replaces, name, len, 1))
+        fixed = 0;
+      if (in_list(batch_allowlist[entry].needs, name, len, 1))
+        *needed = 1;
+      if (name[len] == '\0' &&
+          in_list(batch_allowlist[entry].long_args, name, len, 1)) {
+        if (++i >= nwords)
+          return -1;
+      }
+      continue;
+    }
+
+    // a cluster of short options such as -rf or -m1
+    for (const char *c = word + 1; *c; c++) {
+      const char *spec = strchr(batch_allowlist[entry].opts, *c);
+      if (*c == ':' || spec == NULL)
+        return -1;
+      if (in_list(batch_allowlist[entry].replaces, c, 1, 0))
+        fixed = 0;
+      if (in_list(batch_allowlist[entry].needs, c, 1, 0))
+        *needed = 1;
+      if (spec[1] == ':') {
+        // the value is the rest of the word or the next one
+        if (c[1] == '\0' && ++i >= nwords)
+          return -1;
+        break;
+      }
+    }
+  }
+
+  i += fixed;
+  if (i > nwords)
+    return -1;
+  for (int k = i; !ended && k < nwords; k++) {
+    if (words[k][0] == '-' && words[k][1] != '\0')
+      return -1;
+  }
+  return i;
+}
+
+static int is_redirect(const char *arg) {
+  return strcmp(arg, ">") == 0 || strcmp(arg, ">>") == 0 ||
+         strcmp(arg, "<") == 0;
+}
+
+// every batch appends to the same file, so cmd > a > b cannot be split
+static int output_redirects(char **args) {
+  int n = 0;
+  for (int i = 0; args[i] != NULL; i++) {
+    if (is_redirect(args[i]) && args[i + 1] != NULL)
+      n += strcmp(args[i++], "<") != 0;
+  }
+  return n;
+}
+
+// bytes execve() needs for one argument or environment string
+static size_t arg_cost(const char *s) { return strlen(s) + 1 + sizeof(char *); }
+
+// argv budget left after the environment, or 0 if unknown
+static size_t arg_budget() {
+  long arg_max = sysconf(_SC_ARG_MAX);
+  if (arg_max <= 0)
+    return 0;
+
+  size_t env_size = sizeof(char *);
+  for (char **e = environ; *e != NULL; e++)
+    env_size += arg_cost(*e);
+
+  if ((size_t)arg_max <= env_size + ARSH_ARG_HEADROOM)
+    return 1;
+  return arg_max - env_size - ARSH_ARG_HEADROOM;
+}
+
+int arsh_batch_needed(char **args) {
+  size_t size = sizeof(char *);
+  int last = 0;
+  for (int i = 0; args[i] != NULL; i++) {
+    last = i;
+    if (is_redirect(args[i]) && args[i + 1] != NULL) {
+      i++;
+      last = i;
+      continue;
+    }
+    size += arg_cost(args[i]);
+  }
+
+  size_t budget = arg_budget();
+  if (budget == 0 || size <= budget)
+    return 0;
+
+  // background jobs keep the plain launch path
+  if (strcmp(args[last], "&") == 0)
+    return 0;
+
+  // @nice=5 touch ... is still touch
+  char *cmd = arsh_placement_command(args);
+  int entry = allowlist_lookup(cmd);
+  if (entry < 0) {
+    fprintf(stderr,
+            "arsh: %s: argument list too long; use \"batch %s ...\" to "
+            "split it\n",
+            cmd, cmd);
+    return 0;
+  }
+  if (output_redirects(args) > 1) {
+    fprintf(stderr,
+            "arsh: %s: argument list too long; batches cannot write to "
+            "several outputs\n",
+            cmd);
+    return 0;
+  }
+
+  char **words = malloc((last + 2) * sizeof(char *));
+  if (!words) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  int nwords = 0, at = 0;
+  for (int i = 0; args[i] != NULL; i++) {
+    if (is_redirect(args[i]) && args[i + 1] != NULL) {
+      i++;
+      continue;
+    }
+    if (args[i] == cmd)
+      at = nwords;
+    words[nwords++] = args[i];
+  }
+  int needed;
+  int start = operands_start(words, nwords, at, &needed);
+  free(words);
+
+  if (start == -1) {
+    fprintf(stderr,
+            "arsh: %s: argument list too long, and an unknown option or one "
+            "after the operands keeps it from being split\n",
+            cmd);
+    return 0;
+  }
+  if (batch_allowlist[entry].needs[0] != '\0' && !needed) {
+    fprintf(stderr,
+            "arsh: %s: argument list too long; add -H or -h so batches keep "
+            "the output format, or use \"batch %s ...\"\n",
+            cmd, cmd);
+    return 0;
+  }
+  return 1;
+}
+
+// tally of how the batches of one command ended
+struct batch_result {
+  int batches;
+  int exit_one; // exited 1, e.g. grep finding no match
+  int failed;   // any other non-zero exit, a signal, or no fork at all
+};
+
+// waited is what arsh_stats_wait returned; a batch we could not reap
+// counts as failed
+static void count_batch(struct batch_result *r, pid_t waited, int status) {
+  r->batches++;
+  if (waited == -1) {
+    r->failed++;
+    return;
+  }
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    return;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 1)
+    r->exit_one++;
+  else
+    r->failed++;
+}
+
+// combine batch statuses as xargs does: 123 if any batch failed, except
+// that grep's "no match" only counts when no batch matched at all
+static int batch_status(const struct batch_result *r, const char *cmd) {
+  const char *base = strrchr(cmd, '/');
+  base = base ? base + 1 : cmd;
+  int grep = strcmp(base, "grep") == 0;
+
+  if (r->failed > 0 || (!grep && r->exit_one > 0))
+    return 123;
+  if (grep && r->exit_one > 0 && r->exit_one == r->batches)
+    return 1;
+  return 0;
+}
+
+// run the command as several invocations, each below ARG_MAX, with up to
+// `jobs` of them at once. Placement prefixes, the command's leading options
+// (and, for allowlisted commands, their fixed operands like chmod's mode)
+// are repeated in every batch; see operands_start() for what is refused.
+int arsh_launch_batched(char **args, int jobs) {
+  int argc = 0;
+  while (args[argc] != NULL)
+    argc++;
+
+  char **words = malloc((argc + 1) * sizeof(char *));
+  char **redirs = malloc((argc + 1) * sizeof(char *));
+  if (!words || !redirs) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (output_redirects(args) > 1) {
+    fprintf(stderr, "arsh: batch: cannot split a command with several "
+                    "output redirections\n");
+    free(words);
+    free(redirs);
+    last_exit_status = 1;
+    return 1;
+  }
+
+  int nwords = 0, nredirs = 0;
+  for (int i = 0; i < argc; i++) {
+    if (is_redirect(args[i]) && args[i + 1] != NULL) {
+      // truncate once up front so every batch can append
+      if (strcmp(args[i], ">") == 0) {
+        int fd = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+          perror("arsh: open");
+          free(words);
+          free(redirs);
+          return 1;
+        }
+        close(fd);
+        redirs[nredirs++] = ">>";
+      } else {
+        redirs[nredirs++] = args[i];
+      }
+      redirs[nredirs++] = args[++i];
+      continue;
+    }
+    words[nwords++] = args[i];
+  }
+
+  if (nwords == 0) {
+    free(words);
+    free(redirs);
+    return 1;
+  }
+
+  int cmd = 0;
+  while (cmd < nwords - 1 && arsh_is_placement(words[cmd]))
+    cmd++;
+
+  int needed;
+  int prefix = operands_start(words, nwords, cmd, &needed);
+  if (prefix == -1) {
+    fprintf(stderr,
+            "arsh: batch: %s: cannot tell where the operands start (unknown "
+            "option, or one after the operands)\n",
+            words[cmd]);
+    free(words);
+    free(redirs);
+    last_exit_status = 1;
+    return 1;
+  }
+
+  size_t budget = arg_budget();
+  size_t prefix_size = sizeof(char *);
+  for (int i = 0; i < prefix; i++)
+    prefix_size += arg_cost(words[i]);
+
+  char **batch = malloc((nwords + nredirs + 1) * sizeof(char *));
+  pid_t *running = malloc((jobs > 0 ? jobs : 1) * sizeof(pid_t));
+  if (!batch || !running) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  if (jobs < 1)
+    jobs = 1;
+
+  int nrunning = 0;
+  struct batch_result result = {0, 0, 0};
+  int next = prefix;
+  is_running_command = 1;
+
+  do {
+    int len = 0;
+    for (int i = 0; i < prefix; i++)
+      batch[len++] = words[i];
+
+    // always take at least one operand so an oversized one still runs
+    size_t size = prefix_size;
+    while (next < nwords &&
+           (len == prefix || size + arg_cost(words[next]) <= budget)) {
+      size += arg_cost(words[next]);
+      batch[len++] = words[next++];
+    }
+    for (int i = 0; i < nredirs; i++)
+      batch[len++] = redirs[i];
+    batch[len] = NULL;
+
+    // wait for the oldest batch when the pool is full
+    if (nrunning == jobs) {
+      int status = 0;
+      pid_t waited = arsh_stats_wait(running[0], &status, 0, NULL);
+      count_batch(&result, waited, status);
+      memmove(running, running + 1, (nrunning - 1) * sizeof(pid_t));
+      nrunning--;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      arsh_placement_apply(batch);
+      arsh_redirect(batch);
+      arsh_procsub_prepare_child(batch);
+      if (execvp(batch[0], batch) == -1)
+        perror("arsh");
+      _exit(EXIT_FAILURE);
+    } else if (pid < 0) {
+      perror("arsh");
+      result.failed++;
+      break;
+    }
+
+    arsh_stats_track(pid, words[cmd]);
+    running[nrunning++] = pid;
+  } while (next < nwords);
+
+  for (int i = 0; i < nrunning; i++) {
+    int status = 0;
+    pid_t waited = arsh_stats_wait(running[i], &status, 0, NULL);
+    count_batch(&result, waited, status);
+  }
+
+  is_running_command = 0;
+  last_exit_status = batch_status(&result, words[cmd]);
+
+  free(running);
+  free(batch);
+  free(words);
+  free(redirs);
+  return 1;
+}
+
+// batch [-P jobs] cmd args... : explicit xargs-style splitting
+int arsh_batch_command(char **args) {
+  int jobs = 1;
+  int i = 1;
+
+  if (args[i] != NULL && strcmp(args[i], "-P") == 0) {
+    if (args[i + 1] == NULL || atoi(args[i + 1]) < 1) {
+      fprintf(stderr, "arsh: batch: -P expects a positive job count\n");
+      return 1;
+    }
+    jobs = atoi(args[i + 1]);
+    i += 2;
+  }
+
+  if (args[i] == NULL) {
+    fprintf(stderr, "arsh: expected command after \"batch\"\n");
+    return 1;
+  }
+
+  return arsh_launch_batched(&args[i], jobs);
+}
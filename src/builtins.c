@@ -1,52 +1,183 @@
 #include "../include/builtins.h"
+#include "../include/arith.h"
+#include "../include/audit.h"
+#include "../include/cddb.h"
+#include "../include/scope.h"
 #include "../include/shell.h"
+#include "../include/stats.h"
+#include <errno.h>
+#include <sys/stat.h>
 
-char *builtin_str[] = {"cd", "help", "exit", "export", "unset"};
+char *builtin_str[] = {"cd",    "help",  "exit", "export", "unset",
+                       "stats", "echo",  "read", "let"};
 
-int (*builtin_func[])(char **) = {&arsh_cd, &arsh_help, &arsh_exit,
-                                  &arsh_export, &arsh_unset};
+int (*builtin_func[])(char **) = {&arsh_cd,     &arsh_help,  &arsh_exit,
+                                  &arsh_export, &arsh_unset, &arsh_stats,
+                                  &arsh_echo,   &arsh_read,  &arsh_let};
 
 int arsh_num_biultins() { return sizeof(builtin_str) / sizeof(char *); }
 
+// Builtins running as pipeline stages share the shell process, so each
+// thread gets its own stdout stream and stdin fd.
+static __thread FILE *thread_out = NULL;
+static __thread int thread_in_fd = -1;
+
+void arsh_set_thread_stdio(FILE *out, int in_fd) {
+  thread_out = out;
+  thread_in_fd = in_fd;
+}
+
+FILE *arsh_stdout() { return thread_out ? thread_out : stdout; }
+
+int arsh_stdin_fd() { return thread_in_fd != -1 ? thread_in_fd : STDIN_FILENO; }
+
+// look a relative directory up in each $CDPATH entry (empty means ".").
+// Returns -1 if no entry has it, else 1 if it came from a named entry and
+// should be printed, as POSIX cd does, or 0 for the current directory.
+static int cdpath_lookup(const char *dir, char *out, size_t size) {
+  char *cdpath = getenv("CDPATH");
+  if (cdpath == NULL || dir[0] == '/' || strncmp(dir, "./", 2) == 0 ||
+      strncmp(dir, "../", 3) == 0 || strcmp(dir, ".") == 0 ||
+      strcmp(dir, "..") == 0)
+    return -1;
+
+  const char *entry = cdpath;
+  while (1) {
+    size_t len = strcspn(entry, ":");
+    if (len > 0)
+      snprintf(out, size, "%.*s/%s", (int)len, entry, dir);
+    else
+      snprintf(out, size, "./%s", dir);
+    struct stat st;
+    if (stat(out, &st) == 0 && S_ISDIR(st.st_mode))
+      return len > 0;
+    if (entry[len] == '\0')
+      return -1;
+    entry += len + 1;
+  }
+}
+
+// cd [dir | - | pattern...]: HOME by default, $OLDPWD for "-", then
+// $CDPATH, then the dir itself, and finally the best frecency match
 int arsh_cd(char **args) {
-  if (args[1] == NULL)
-    fprintf(stderr, "arsh: expected argument to \"cd\"\n");
-  else {
-    if (chdir(args[1]) != 0) {
-      perror("arsh");
+  char *target = args[1];
+  char found[PATH_MAX];
+  int show = 0;
+  int cdpath = -1;
+  struct stat st;
+
+  if (target == NULL) {
+    target = getenv("HOME");
+    if (target == NULL) {
+      fprintf(stderr, "arsh: cd: HOME not set\n");
+      last_exit_status = 1;
+      return 1;
+    }
+  } else if (strcmp(target, "-") == 0 && args[2] == NULL) {
+    target = getenv("OLDPWD");
+    if (target == NULL) {
+      fprintf(stderr, "arsh: cd: OLDPWD not set\n");
+      last_exit_status = 1;
+      return 1;
     }
+    show = 1;
+  } else if (args[2] == NULL &&
+             (cdpath = cdpath_lookup(target, found, sizeof(found))) != -1) {
+    target = found;
+    show = cdpath;
+  } else if (args[2] != NULL || stat(target, &st) != 0) {
+    if (arsh_cddb_query(&args[1], found, sizeof(found)) == 0) {
+      target = found;
+      show = 1;
+    } else if (args[2] != NULL) {
+      fprintf(stderr, "arsh: cd: no directory matches");
+      for (int i = 1; args[i] != NULL; i++)
+        fprintf(stderr, " %s", args[i]);
+      fprintf(stderr, "\n");
+      last_exit_status = 1;
+      return 1;
+    }
+  }
+
+  char old[PATH_MAX];
+  if (getcwd(old, sizeof(old)) == NULL)
+    old[0] = '\0';
+
+  arsh_scope_touch_cwd();
+  if (chdir(target) != 0) {
+    fprintf(stderr, "arsh: cd: %s: %s\n", target, strerror(errno));
+    last_exit_status = 1;
+    return 1;
+  }
+
+  char cwd[PATH_MAX] = "";
+  arsh_scope_touch_env();
+  if (old[0] != '\0')
+    setenv("OLDPWD", old, 1);
+  if (getcwd(cwd, sizeof(cwd)) != NULL) {
+    setenv("PWD", cwd, 1);
+    arsh_cddb_add(cwd);
+  }
+  arsh_audit_set_cwd(cwd[0] != '\0' ? cwd : NULL);
+
+  if (show && cwd[0] != '\0') {
+    fprintf(arsh_stdout(), "%s\n", cwd);
+    fflush(arsh_stdout());
   }
+  last_exit_status = 0;
   return 1;
 }
 
 int arsh_help(char **args) {
   (void)args;
-  printf("==================================================\n");
-  printf("                  ARSH SHELL HELP                 \n");
-  printf("==================================================\n");
-  printf("Type program names and arguments, and hit enter.\n\n");
-
-  printf("Built-in Commands:\n");
-  printf("  cd [dir]       : Change the current directory\n");
-  printf("  help           : Display this help message\n");
-  printf("  exit           : Exit the shell\n");
-  printf("  export KEY=VAL : Set an environment variable\n");
-  printf("  unset KEY      : Unset an environment variable\n\n");
-
-  printf("Shell Features:\n");
-  printf("  > file         : Redirect output to a file (overwrite)\n");
-  printf("  >> file        : Redirect output to a file (append)\n");
-  printf("  < file         : Redirect input from a file\n");
-  printf("  cmd1 | cmd2    : Pipe output of cmd1 to cmd2\n");
-  printf("  cmd1 && cmd2   : Run cmd2 only if cmd1 succeeds\n");
-  printf("  cmd1 || cmd2   : Run cmd2 only if cmd1 fails\n");
-  printf("  cmd &          : Run command in background\n");
-  printf("  * ?            : Wildcard expansion (globbing)\n");
-  printf("  $VAR           : Environment variable expansion\n");
-  printf("  $?             : Exit status of the last command\n\n");
-
-  printf("Use 'man' for information on other programs.\n");
-  printf("==================================================\n");
+  FILE *out = arsh_stdout();
+
+  fprintf(out, "==================================================\n");
+  fprintf(out, "                  ARSH SHELL HELP                 \n");
+  fprintf(out, "==================================================\n");
+  fprintf(out, "Type program names and arguments, and hit enter.\n\n");
+
+  fprintf(out, "Built-in Commands:\n");
+  fprintf(out, "  cd [dir]       : Change the current directory (HOME by default)\n");
+  fprintf(out, "  cd -           : Return to the previous directory\n");
+  fprintf(out, "  cd pattern...  : Jump to the most frecent matching directory\n");
+  fprintf(out, "  help           : Display this help message\n");
+  fprintf(out, "  exit           : Exit the shell\n");
+  fprintf(out, "  export KEY=VAL : Set an environment variable\n");
+  fprintf(out, "  unset KEY      : Unset an environment variable\n");
+  fprintf(out, "  stats [reset]  : Show per-command latency percentiles\n");
+  fprintf(out, "  echo [-n] args : Print arguments\n");
+  fprintf(out, "  read NAME...   : Read a line into variables\n");
+  fprintf(out, "  let EXPR...    : Evaluate arithmetic, e.g. let i+=1\n\n");
+
+  fprintf(out, "Shell Features:\n");
+  fprintf(out, "  > file         : Redirect output to a file (overwrite)\n");
+  fprintf(out, "  >> file        : Redirect output to a file (append)\n");
+  fprintf(out, "  < file         : Redirect input from a file\n");
+  fprintf(out, "  > a > b | cmd  : Send output to several targets at once\n");
+  fprintf(out, "  cmd1 | cmd2    : Pipe output of cmd1 to cmd2\n");
+  fprintf(out, "  profile a | b  : Show per-stage and per-edge pipeline stats\n");
+  fprintf(out, "  <(cmd) >(cmd)  : Process substitution via /dev/fd/N\n");
+  fprintf(out, "  cmd1 ; cmd2    : Run cmd1, then cmd2\n");
+  fprintf(out, "  cmd1 && cmd2   : Run cmd2 only if cmd1 succeeds\n");
+  fprintf(out, "  cmd1 || cmd2   : Run cmd2 only if cmd1 fails\n");
+  fprintf(out, "  cmd &          : Run command in background\n");
+  fprintf(out, "  @cpus=0-3 @nice=N @io=idle|be:N @sched=batch cmd\n");
+  fprintf(out, "                 : Place cmd on cpus / priority / io class\n");
+  fprintf(out, "  @pin[=0-3] a | b: Pin consecutive stages to neighbouring cores\n");
+  fprintf(out, "  ( list )       : Run list in a subshell (scoped cd/export)\n");
+  fprintf(out, "  { list; }      : Group commands in the current shell\n");
+  fprintf(out, "  NAME=value     : Set a variable\n");
+  fprintf(out, "  time cmd       : Report wall/cpu time, rss, ctx switches, io\n");
+  fprintf(out, "  * ?            : Wildcard expansion (globbing)\n");
+  fprintf(out, "  batch [-P n] cmd: Split huge argument lists under ARG_MAX\n");
+  fprintf(out, "  $VAR           : Environment variable expansion\n");
+  fprintf(out, "  $?             : Exit status of the last command\n");
+  fprintf(out, "  $((expr))      : 64-bit integer arithmetic\n");
+  fprintf(out, "  $ARSH_STATS_LOG: Append per-command stats to this JSONL file\n\n");
+
+  fprintf(out, "Use 'man' for information on other programs.\n");
+  fprintf(out, "==================================================\n");
   return 1;
 }
 
@@ -74,6 +205,7 @@ int arsh_export(char **args) {
   char *key = arg;
   char *value = equal_sign + 1;
 
+  arsh_scope_touch_env();
   if (setenv(key, value, 1) != 0) {
     perror("arsh");
   }
@@ -86,9 +218,114 @@ int arsh_unset(char **args) {
     return 1;
   }
 
+  arsh_scope_touch_env();
   if (unsetenv(args[1]) != 0) {
     perror("arsh");
   }
 
   return 1;
 }
+
+int arsh_stats(char **args) {
+  if (args[1] != NULL && strcmp(args[1], "reset") == 0) {
+    arsh_stats_reset();
+    return 1;
+  }
+
+  arsh_stats_report(arsh_stdout());
+  return 1;
+}
+
+int arsh_echo(char **args) {
+  FILE *out = arsh_stdout();
+  int newline = 1;
+  int i = 1;
+
+  if (args[i] != NULL && strcmp(args[i], "-n") == 0) {
+    newline = 0;
+    i++;
+  }
+
+  for (; args[i] != NULL; i++) {
+    fputs(args[i], out);
+    if (args[i + 1] != NULL)
+      fputc(' ', out);
+  }
+  if (newline)
+    fputc('\n', out);
+  fflush(out);
+
+  last_exit_status = 0;
+  return 1;
+}
+
+int arsh_read(char **args) {
+  if (args[1] == NULL) {
+    fprintf(stderr, "arsh: expected argument to \"read\"\n");
+    last_exit_status = 1;
+    return 1;
+  }
+
+  // one byte at a time so nothing past the newline is consumed
+  int fd = arsh_stdin_fd();
+  size_t len = 0, cap = 128;
+  char *line = malloc(cap);
+  if (!line) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char c;
+  ssize_t n;
+  while ((n = read(fd, &c, 1)) == 1 && c != '\n') {
+    if (len + 1 >= cap) {
+      cap *= 2;
+      line = realloc(line, cap);
+      if (!line) {
+        fprintf(stderr, "arsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    line[len++] = c;
+  }
+  line[len] = '\0';
+
+  // split on whitespace; the last name takes the rest of the line
+  arsh_scope_touch_env();
+  char *p = line;
+  for (int i = 1; args[i] != NULL; i++) {
+    while (*p == ' ' || *p == '\t')
+      p++;
+    char *value = p;
+    if (args[i + 1] != NULL) {
+      p += strcspn(p, " \t");
+      if (*p != '\0')
+        *p++ = '\0';
+    }
+    if (setenv(args[i], value, 1) != 0)
+      perror("arsh");
+  }
+
+  last_exit_status = (n != 1 && len == 0) ? 1 : 0;
+  free(line);
+  return 1;
+}
+
+// let EXPR...: evaluate each expression; succeeds if the last one is non-zero
+int arsh_let(char **args) {
+  if (args[1] == NULL) {
+    fprintf(stderr, "arsh: expected argument to \"let\"\n");
+    last_exit_status = 1;
+    return 1;
+  }
+
+  long long value = 0;
+  for (int i = 1; args[i] != NULL; i++) {
+    if (arsh_arith_eval(args[i], &value) == -1) {
+      last_exit_status = 1;
+      return 1;
+    }
+  }
+  last_exit_status = value == 0;
+  return 1;
+}
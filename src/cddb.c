@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+
+#include "../include/cddb.h"
+#include "../include/shell.h"
+#include <errno.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define ARSH_CDDB_ENTRY_SIZE 256
+#define ARSH_CDDB_PATH_MAX (ARSH_CDDB_ENTRY_SIZE - 24)
+#define ARSH_CDDB_MAGIC "ARSHCDB1"
+#define ARSH_CDDB_INITIAL 64        // entries in a new database
+#define ARSH_CDDB_MAX_TOTAL 10000.0 // summed rank that triggers aging
+#define ARSH_CDDB_AGING 0.9
+#define ARSH_CDDB_CANDIDATES 8
+
+// The database is one file of fixed 256-byte slots: slot 0 is the header,
+// the rest are entries packed at the front. It is mmap'd for each lookup
+// and update and guarded by flock(), so concurrent shells share it.
+struct cddb_header {
+  char magic[8];
+  uint32_t count;
+  uint32_t reserved;
+  double total; // sum of all ranks
+};
+
+struct cddb_entry {
+  double rank;  // number of visits, decayed by aging
+  int64_t last; // time of the last visit
+  uint32_t hash;
+  uint32_t len;
+  char path[ARSH_CDDB_PATH_MAX];
+};
+
+_Static_assert(sizeof(struct cddb_entry) == ARSH_CDDB_ENTRY_SIZE,
+               "cd database entries must stay 256 bytes");
+
+struct cddb_map {
+  int fd;
+  int writable;
+  char *base;
+  size_t size;
+  struct cddb_header *hdr;
+  struct cddb_entry *entries;
+  uint32_t capacity;
+};
+
+// $ARSH_CDDB, or ~/.arsh_dirs
+static int db_path(char *buf, size_t size) {
+  char *path = getenv("ARSH_CDDB");
+  if (path != NULL && path[0] != '\0') {
+    snprintf(buf, size, "%s", path);
+    return 0;
+  }
+
+  char *home = getenv("HOME");
+  if (home == NULL || home[0] == '\0')
+    return -1;
+  snprintf(buf, size, "%s/.arsh_dirs", home);
+  return 0;
+}
+
+static uint32_t hash_path(const char *s) {
+  uint32_t h = 2166136261u;
+  for (; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static int map_db(struct cddb_map *db) {
+  int prot = PROT_READ | (db->writable ? PROT_WRITE : 0);
+  db->base = mmap(NULL, db->size, prot, MAP_SHARED, db->fd, 0);
+  if (db->base == MAP_FAILED) {
+    perror("arsh: cd database");
+    return -1;
+  }
+
+  db->hdr = (struct cddb_header *)db->base;
+  db->entries = (struct cddb_entry *)(db->base + ARSH_CDDB_ENTRY_SIZE);
+  db->capacity = db->size / ARSH_CDDB_ENTRY_SIZE - 1;
+  return 0;
+}
+
+static void close_db(struct cddb_map *db) {
+  munmap(db->base, db->size);
+  close(db->fd); // also drops the flock
+}
+
+// open and lock the database; a missing database is only created for writing
+static int open_db(struct cddb_map *db, int writable) {
+  char path[PATH_MAX];
+  if (db_path(path, sizeof(path)) == -1)
+    return -1;
+
+  db->writable = writable;
+  db->fd = open(path, (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC,
+                0600);
+  if (db->fd == -1) {
+    if (errno != ENOENT)
+      perror("arsh: cd database");
+    return -1;
+  }
+
+  if (flock(db->fd, writable ? LOCK_EX : LOCK_SH) == -1) {
+    perror("arsh: cd database lock");
+    close(db->fd);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(db->fd, &st) == -1) {
+    perror("arsh: cd database");
+    close(db->fd);
+    return -1;
+  }
+
+  int fresh = st.st_size < ARSH_CDDB_ENTRY_SIZE * 2;
+  if (fresh) {
+    if (!writable) {
+      close(db->fd);
+      return -1;
+    }
+    st.st_size = ARSH_CDDB_ENTRY_SIZE * (ARSH_CDDB_INITIAL + 1);
+    if (ftruncate(db->fd, st.st_size) == -1) {
+      perror("arsh: cd database");
+      close(db->fd);
+      return -1;
+    }
+  }
+
+  db->size = st.st_size - st.st_size % ARSH_CDDB_ENTRY_SIZE;
+  if (map_db(db) == -1) {
+    close(db->fd);
+    return -1;
+  }
+
+  if (fresh) {
+    memset(db->hdr, 0, sizeof(*db->hdr));
+    memcpy(db->hdr->magic, ARSH_CDDB_MAGIC, sizeof(db->hdr->magic));
+  } else if (memcmp(db->hdr->magic, ARSH_CDDB_MAGIC,
+                    sizeof(db->hdr->magic)) != 0) {
+    fprintf(stderr, "arsh: %s is not a cd database\n", path);
+    close_db(db);
+    return -1;
+  }
+
+  // a truncated file loses its tail entries; only writers repair the count
+  if (writable && db->hdr->count > db->capacity)
+    db->hdr->count = db->capacity;
+  return 0;
+}
+
+static int grow_db(struct cddb_map *db) {
+  size_t size = db->size * 2;
+  if (ftruncate(db->fd, size) == -1) {
+    perror("arsh: cd database");
+    return -1;
+  }
+  munmap(db->base, db->size);
+  db->size = size;
+  return map_db(db);
+}
+
+// decay every rank once the total grows too large, forgetting directories
+// that fall below one visit
+static void age_db(struct cddb_map *db) {
+  struct cddb_header *hdr = db->hdr;
+  double total = 0;
+
+  for (uint32_t i = 0; i < hdr->count; i++) {
+    struct cddb_entry *e = &db->entries[i];
+    e->rank *= ARSH_CDDB_AGING;
+    if (e->rank < 1.0) {
+      *e = db->entries[--hdr->count];
+      i--;
+      continue;
+    }
+    total += e->rank;
+  }
+  hdr->total = total;
+}
+
+// record a visit to dir, an absolute path
+void arsh_cddb_add(const char *dir) {
+  size_t len = strlen(dir);
+  if (len >= ARSH_CDDB_PATH_MAX)
+    return;
+
+  struct cddb_map db;
+  if (open_db(&db, 1) == -1)
+    return;
+
+  uint32_t hash = hash_path(dir);
+  struct cddb_entry *e = NULL;
+  for (uint32_t i = 0; i < db.hdr->count; i++) {
+    struct cddb_entry *cur = &db.entries[i];
+    if (cur->hash == hash && cur->len == len &&
+        memcmp(cur->path, dir, len) == 0) {
+      e = cur;
+      break;
+    }
+  }
+
+  if (e == NULL) {
+    if (db.hdr->count >= db.capacity && grow_db(&db) == -1) {
+      close_db(&db);
+      return;
+    }
+    e = &db.entries[db.hdr->count++];
+    memset(e, 0, sizeof(*e));
+    e->hash = hash;
+    e->len = len;
+    memcpy(e->path, dir, len);
+  }
+
+  e->rank += 1.0;
+  e->last = time(NULL);
+  db.hdr->total += 1.0;
+  if (db.hdr->total > ARSH_CDDB_MAX_TOTAL)
+    age_db(&db);
+
+  close_db(&db);
+}
+
+// visits weighted by how recently the last one was
+static double frecency(const struct cddb_entry *e, time_t now) {
+  double age = difftime(now, e->last);
+  if (age < 3600)
+    return e->rank * 4;
+  if (age < 86400)
+    return e->rank * 2;
+  if (age < 604800)
+    return e->rank / 2;
+  return e->rank / 4;
+}
+
+// every term must appear in order, case-insensitively, and the last one in
+// the final path component
+static int matches(const char *path, char **terms) {
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+
+  // the basename test rejects most entries cheaply, so do it first
+  int last = 0;
+  while (terms[last + 1] != NULL)
+    last++;
+  if (strcasestr(base, terms[last]) == NULL)
+    return 0;
+
+  const char *p = path;
+  for (int i = 0; terms[i] != NULL; i++) {
+    if (terms[i + 1] == NULL && p < base)
+      p = base;
+    const char *hit = strcasestr(p, terms[i]);
+    if (hit == NULL)
+      return 0;
+    p = hit + strlen(terms[i]);
+  }
+  return 1;
+}
+
+// copy the best-ranked existing directory matching terms into out.
+// Returns -1 when nothing matches.
+int arsh_cddb_query(char **terms, char *out, size_t size) {
+  struct cddb_map db;
+  if (open_db(&db, 0) == -1)
+    return -1;
+
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    cwd[0] = '\0';
+  time_t now = time(NULL);
+
+  // best few candidates, highest score first; stale ones are skipped below
+  struct {
+    double score;
+    uint32_t index;
+  } best[ARSH_CDDB_CANDIDATES];
+  int nbest = 0;
+
+  uint32_t count = db.hdr->count < db.capacity ? db.hdr->count : db.capacity;
+  for (uint32_t i = 0; i < count; i++) {
+    struct cddb_entry *e = &db.entries[i];
+    if (e->len >= ARSH_CDDB_PATH_MAX || e->path[e->len] != '\0')
+      continue;
+    if (!matches(e->path, terms) || strcmp(e->path, cwd) == 0)
+      continue;
+
+    double score = frecency(e, now);
+    if (nbest == ARSH_CDDB_CANDIDATES && score <= best[nbest - 1].score)
+      continue;
+
+    int j = nbest < ARSH_CDDB_CANDIDATES ? nbest++ : nbest - 1;
+    while (j > 0 && best[j - 1].score < score) {
+      best[j] = best[j - 1];
+      j--;
+    }
+    best[j].score = score;
+    best[j].index = i;
+  }
+
+  int found = -1;
+  for (int i = 0; i < nbest && found == -1; i++) {
+    const char *path = db.entries[best[i].index].path;
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+      snprintf(out, size, "%s", path);
+      found = 0;
+    }
+  }
+
+  close_db(&db);
+  return found;
+}
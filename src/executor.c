@@ -1,7 +1,109 @@
+#define _GNU_SOURCE
+
 #include "../include/executor.h"
+#include "../include/arith.h"
+#include "../include/audit.h"
+#include "../include/batch.h"
 #include "../include/builtins.h"
 #include "../include/parser.h"
+#include "../include/placement.h"
+#include "../include/procsub.h"
+#include "../include/profile.h"
+#include "../include/scope.h"
 #include "../include/shell.h"
+#include "../include/stats.h"
+#include "../include/tee.h"
+#include <pthread.h>
+#include <time.h>
+
+// apply >, >> and < redirections in a forked child; the command's argv is
+// terminated at the first redirection operator. Children leave with _exit()
+// so a failed exec can't flush stdio the shell still owns (exit() would
+// rewind a script being read through the shared fd).
+void arsh_redirect(char **args) {
+  for (int i = 0; args[i] != NULL; i++) {
+    // append redirection
+    if (strcmp(args[i], ">>") == 0) {
+      if (args[i + 1] == NULL) {
+        fprintf(stderr, "arsh: expected argument to \">>\"\n");
+        _exit(EXIT_FAILURE);
+      }
+
+      char *filename = args[i + 1];
+      int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+      if (fd == -1) {
+        perror("arsh: open append");
+        _exit(EXIT_FAILURE);
+      }
+
+      if (dup2(fd, STDOUT_FILENO) == -1) {
+        perror("arsh: dup2 append");
+        _exit(EXIT_FAILURE);
+      }
+      close(fd);
+
+      args[i] = NULL;
+      continue;
+    }
+
+    // output redirection
+    if (strcmp(args[i], ">") == 0) {
+      if (args[i + 1] == NULL) {
+        fprintf(stderr, "arsh: expected argument to \">\"\n");
+        _exit(EXIT_FAILURE);
+      }
+
+      char *filename = args[i + 1];
+
+      int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+      if (fd == -1) {
+        perror("arsh: open");
+        _exit(EXIT_FAILURE);
+      }
+
+      // redirection
+      if (dup2(fd, STDOUT_FILENO) == -1) {
+        perror("arsh: dup2");
+        _exit(EXIT_FAILURE);
+      }
+
+      close(fd);
+
+      // remove ">" and filename from command
+      args[i] = NULL;
+      continue;
+    }
+
+    // input redirection
+    if (strcmp(args[i], "<") == 0) {
+      if (args[i + 1] == NULL) {
+        fprintf(stderr, "arsh: expected argement to \">\"\n");
+        _exit(EXIT_FAILURE);
+      }
+
+      char *filename = args[i + 1];
+
+      int fd = open(filename, O_RDONLY);
+
+      if (fd == -1) {
+        perror("arsh: open input file");
+        _exit(EXIT_FAILURE);
+      }
+
+      if (dup2(fd, STDIN_FILENO) == -1) {
+        perror("arsh: dup2 input");
+        _exit(EXIT_FAILURE);
+      }
+
+      close(fd);
+
+      args[i] = NULL;
+      continue;
+    }
+  }
+}
 
 int arsh_launch(char **args) {
   pid_t pid;
@@ -18,6 +120,17 @@ int arsh_launch(char **args) {
     args[i - 1] = NULL;
   }
 
+  // cmd > a > b: a relay thread in the shell fans the output out
+  struct arsh_tee *tee = NULL;
+  int tee_fd = -1;
+  if (arsh_tee_outputs(args) > 1) {
+    tee = arsh_tee_setup(args, -1, &tee_fd);
+    if (tee == NULL) {
+      last_exit_status = 1;
+      return 1;
+    }
+  }
+
   // ONLY set this for FOREGROUND commands.
   if (!background) {
     is_running_command = 1;
@@ -26,135 +139,224 @@ int arsh_launch(char **args) {
   pid = fork();
   if (pid == 0) {
     // child process
-    // scan for redirection
-    for (int i = 0; args[i] != NULL; i++) {
-      // append redirection
-      if (strcmp(args[i], ">>") == 0) {
-        if (args[i + 1] == NULL) {
-          fprintf(stderr, "arsh: expected argument to \">>\"\n");
-          exit(EXIT_FAILURE);
-        }
-
-        char *filename = args[i + 1];
-        int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (tee_fd != -1)
+      dup2(tee_fd, STDOUT_FILENO);
+    if (background)
+      arsh_placement_background();
+    arsh_placement_apply(args);
+    arsh_redirect(args);
+
+    arsh_procsub_prepare_child(args);
+    if (execvp(args[0], args) == -1)
+      perror("arsh");
+    _exit(EXIT_FAILURE);
+  }
 
-        if (fd == -1) {
-          perror("arsh: open append");
-          exit(EXIT_FAILURE);
-        }
+  if (tee != NULL) {
+    close(tee_fd);
+    if (arsh_tee_start(tee, background && pid > 0) == -1)
+      tee = NULL;
+  }
 
-        if (dup2(fd, STDOUT_FILENO) == -1) {
-          perror("arsh: dup2 append");
-          exit(EXIT_FAILURE);
-        }
-        close(fd);
+  if (pid < 0) {
+    perror("arsh");
+    is_running_command = 0;
+    if (tee != NULL)
+      arsh_tee_finish(tee);
+  } else { // parent process
+    arsh_stats_track(pid, arsh_placement_command(args));
+    if (!background) {
+      // foreground: wait for the child to finish
+      int waited;
+      do {
+        waited = arsh_stats_wait(pid, &status, WUNTRACED, NULL);
+      } while (waited > 0 && !WIFEXITED(status) && !WIFSIGNALED(status));
 
-        args[i] = NULL;
-        continue;
+      if (waited <= 0) {
+        perror("arsh: wait");
+        last_exit_status = 1;
+      } else if (WIFEXITED(status)) {
+        last_exit_status = WEXITSTATUS(status);
       }
+      if (tee != NULL)
+        arsh_tee_finish(tee);
+      is_running_command = 0;
+    } else {
+      // background
+      printf("[Process Started] PID: %d\n", pid);
+    }
+  }
 
-      // output redirection
-      if (strcmp(args[i], ">") == 0) {
-        if (args[i + 1] == NULL) {
-          fprintf(stderr, "arsh: expected argument to \">\"\n");
-          exit(EXIT_FAILURE);
-        }
-
-        char *filename = args[i + 1];
-
-        int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  return 1;
+}
 
-        if (fd == -1) {
-          perror("arsh: open");
-          exit(EXIT_FAILURE);
-        }
+// whether the token after prev starts a new command
+static int starts_command(const char *prev) {
+  return strcmp(prev, ";") == 0 || strcmp(prev, "&&") == 0 ||
+         strcmp(prev, "||") == 0 || strcmp(prev, "|") == 0 ||
+         strcmp(prev, "&") == 0 || strcmp(prev, "(") == 0 ||
+         strcmp(prev, "{") == 0 || strcmp(prev, "time") == 0;
+}
 
-        // redirection
-        if (dup2(fd, STDOUT_FILENO) == -1) {
-          perror("arsh: dup2");
-          exit(EXIT_FAILURE);
-        }
+// Walk args tracking ( ) and { } nesting; "{" and "}" only count in command
+// position, as in other shells. Returns the index of the first (or last)
+// top-level op, or with op NULL the index that closes the group at args[0].
+static int scan_tokens(char **args, const char *op, int last) {
+  int depth = 0;
+  int cmd_start = 1;
+  int found = -1;
 
-        close(fd);
+  for (int i = 0; args[i] != NULL; i++) {
+    const char *a = args[i];
+    if (strcmp(a, "(") == 0 || (cmd_start && strcmp(a, "{") == 0)) {
+      depth++;
+    } else if (depth > 0 && (strcmp(a, ")") == 0 ||
+                             (cmd_start && strcmp(a, "}") == 0))) {
+      depth--;
+      if (op == NULL && depth == 0)
+        return i;
+    } else if (op != NULL && depth == 0 && strcmp(a, op) == 0) {
+      if (!last)
+        return i;
+      found = i;
+    }
+    cmd_start = starts_command(a);
+  }
+  return found;
+}
 
-        // remove ">" and filename from command
-        args[i] = NULL;
-        continue;
-      }
+static int find_builtin(const char *name) {
+  for (int i = 0; i < arsh_num_biultins(); i++) {
+    if (strcmp(name, builtin_str[i]) == 0)
+      return i;
+  }
+  return -1;
+}
 
-      // input redirection
-      if (strcmp(args[i], "<") == 0) {
-        if (args[i + 1] == NULL) {
-          fprintf(stderr, "arsh: expected argement to \">\"\n");
-          exit(EXIT_FAILURE);
-        }
+static int is_assignment(const char *word) {
+  if (!isalpha((unsigned char)word[0]) && word[0] != '_')
+    return 0;
+  for (int i = 1; word[i] != '\0'; i++) {
+    if (word[i] == '=')
+      return 1;
+    if (!isalnum((unsigned char)word[i]) && word[i] != '_')
+      return 0;
+  }
+  return 0;
+}
 
-        char *filename = args[i + 1];
+// a group body made only of builtins, assignments and nested groups never
+// needs a process of its own
+static int runs_in_process(char **body) {
+  int cmd_start = 1;
+  for (int i = 0; body[i] != NULL; i++) {
+    const char *a = body[i];
+    if (strcmp(a, "|") == 0 || strcmp(a, "&") == 0)
+      return 0;
+    if (cmd_start && strcmp(a, "(") != 0 && strcmp(a, "{") != 0 &&
+        strcmp(a, "}") != 0 && strcmp(a, ")") != 0 && find_builtin(a) < 0 &&
+        !is_assignment(a))
+      return 0;
+    cmd_start = starts_command(a);
+  }
+  return 1;
+}
 
-        int fd = open(filename, O_RDONLY);
+// ( list ) and { list; } followed by optional redirections and "&".
+// Subshells run in-process against a copy-on-write scope when they only
+// use builtins; otherwise (and for background groups) they fork.
+static int launch_group(char **args) {
+  int end = scan_tokens(args, NULL, 0);
+  if (end == -1) {
+    fprintf(stderr, "arsh: missing \"%s\" to close group\n",
+            args[0][0] == '(' ? ")" : "}");
+    return 1;
+  }
 
-        if (fd == -1) {
-          perror("arsh: open input file");
-          exit(EXIT_FAILURE);
-        }
+  int subshell = strcmp(args[0], "(") == 0;
+  args[end] = NULL;
+  char **body = &args[1];
+  char **rest = &args[end + 1];
 
-        if (dup2(fd, STDIN_FILENO) == -1) {
-          perror("arsh: dup2 input");
-          exit(EXIT_FAILURE);
-        }
+  int background = 0;
+  int n = 0;
+  while (rest[n] != NULL)
+    n++;
+  if (n > 0 && strcmp(rest[n - 1], "&") == 0) {
+    background = 1;
+    rest[n - 1] = NULL;
+  }
 
-        close(fd);
+  if (!background && (!subshell || runs_in_process(body))) {
+    int status = 1;
+    arsh_scope_push(subshell);
+    if (arsh_scope_redirect(rest) == 0)
+      status = arsh_logic_split(body);
+    else
+      last_exit_status = 1;
+    arsh_scope_pop();
+
+    // exit inside ( ) only leaves the subshell
+    return subshell ? 1 : status;
+  }
 
-        args[i] = NULL;
-        continue;
-      }
-    }
+  fflush(stdout);
+  fflush(stderr);
+  if (!background)
+    is_running_command = 1;
 
-    if (execvp(args[0], args) == -1)
-      perror("arsh");
-    exit(EXIT_FAILURE);
+  pid_t pid = fork();
+  if (pid == 0) {
+    arsh_audit_init();
+    arsh_redirect(rest);
+    arsh_logic_split(body);
+    arsh_audit_flush();
+    fflush(stdout);
+    fflush(stderr);
+    _exit(last_exit_status);
   } else if (pid < 0) {
     perror("arsh");
     is_running_command = 0;
-  } else { // parent process
-    if (!background) {
-      // foreground: wait for the child to finish
-      do {
-        waitpid(pid, &status, WUNTRACED);
-      } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    return 1;
+  }
 
-      if (WIFEXITED(status)) {
-        last_exit_status = WEXITSTATUS(status);
-      }
-      is_running_command = 0;
-    } else {
-      // background
-      printf("[Process Started] PID: %d\n", pid);
-    }
+  arsh_stats_track(pid, subshell ? "(subshell)" : "{group}");
+  if (background) {
+    printf("[Process Started] PID: %d\n", pid);
+    return 1;
   }
 
+  int status, waited;
+  do {
+    waited = arsh_stats_wait(pid, &status, WUNTRACED, NULL);
+  } while (waited > 0 && !WIFEXITED(status) && !WIFSIGNALED(status));
+  if (waited <= 0) {
+    perror("arsh: wait");
+    last_exit_status = 1;
+  } else if (WIFEXITED(status)) {
+    last_exit_status = WEXITSTATUS(status);
+  }
+  is_running_command = 0;
   return 1;
 }
 
-// handle && and || logic
+// handle ;, && and || logic
 int arsh_logic_split(char **args) {
-  int split_idx = -1;
-  int type = 0; // 1 for &&, 2 for ||
-
-  for (int i = 0; args[i] != NULL; i++) {
-    if (strcmp(args[i], "&&") == 0) {
-      split_idx = i;
-      type = 1;
-      break;
-    }
-
-    else if (strcmp(args[i], "||") == 0) {
-      split_idx = i;
-      type = 2;
-      break;
-    }
+  // ';' binds loosest: run each side in turn
+  int seq_idx = scan_tokens(args, ";", 0);
+  if (seq_idx != -1) {
+    args[seq_idx] = NULL;
+    if (!arsh_logic_split(args))
+      return 0;
+    return arsh_logic_split(&args[seq_idx + 1]);
   }
 
+  // && and || are left-associative: split at the last one
+  int and_idx = scan_tokens(args, "&&", 1);
+  int or_idx = scan_tokens(args, "||", 1);
+  int split_idx = and_idx > or_idx ? and_idx : or_idx;
+  int type = and_idx > or_idx ? 1 : 2; // 1 for &&, 2 for ||
+
   if (split_idx == -1) {
     return arsh_launch_pipeline(args);
   }
@@ -163,6 +365,8 @@ int arsh_logic_split(char **args) {
   char **cmd2 = &args[split_idx + 1];
 
   int loop_status = arsh_logic_split(args);
+  if (!loop_status)
+    return 0;
 
   if (type == 1) {
     if (last_exit_status == 0) {
@@ -177,90 +381,595 @@ int arsh_logic_split(char **args) {
   return loop_status;
 }
 
-// pipe
-int arsh_launch_pipe(char **args, int pipe_pos) {
-  int pipefd[2];
-  pid_t p1, p2;
+// a builtin pipeline stage, run on a thread of the shell
+struct builtin_stage {
+  char **args;
+  int builtin;
+  int in_fd;
+  int out_fd;
+  double wall_ms;
+  pthread_t thread;
+};
+
+static double monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
 
-  args[pipe_pos] = NULL;
-  char **cmd2 = &args[pipe_pos + 1];
+static void *builtin_stage_main(void *arg) {
+  struct builtin_stage *st = arg;
+  double start = monotonic_ms();
+
+  // writing to a consumer that already exited must not kill the shell
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  FILE *out = st->out_fd != -1 ? fdopen(st->out_fd, "w") : NULL;
+  arsh_set_thread_stdio(out, st->in_fd);
+  (*builtin_func[st->builtin])(st->args);
+
+  if (out != NULL)
+    fclose(out);
+  else
+    fflush(stdout);
+  if (st->in_fd != -1)
+    close(st->in_fd);
+
+  st->wall_ms = monotonic_ms() - start;
+  return NULL;
+}
 
-  if (pipe(pipefd) < 0) {
-    perror("arsh: pipe");
-    return 1;
+// open a builtin stage's >, >> and < targets in place of its pipe ends
+static void builtin_stage_redirect(struct builtin_stage *st) {
+  for (int i = 0; st->args[i] != NULL; i++) {
+    int flags, *target;
+    if (strcmp(st->args[i], ">>") == 0) {
+      flags = O_WRONLY | O_CREAT | O_APPEND;
+      target = &st->out_fd;
+    } else if (strcmp(st->args[i], ">") == 0) {
+      flags = O_WRONLY | O_CREAT | O_TRUNC;
+      target = &st->out_fd;
+    } else if (strcmp(st->args[i], "<") == 0) {
+      flags = O_RDONLY;
+      target = &st->in_fd;
+    } else {
+      continue;
+    }
+
+    if (st->args[i + 1] == NULL) {
+      fprintf(stderr, "arsh: expected argument to \"%s\"\n", st->args[i]);
+      st->args[i] = NULL;
+      return;
+    }
+
+    int fd = open(st->args[i + 1], flags | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      perror("arsh: open");
+    } else {
+      if (*target != -1)
+        close(*target);
+      *target = fd;
+    }
+    st->args[i] = NULL;
   }
+}
 
-  is_running_command = 1;
+// run every stage of a pipeline; with profile set, a shell-owned relay sits
+// on each edge and a per-stage/per-edge summary is printed at the end
+static int launch_stages(char **args, int profile) {
+  int n = 1;
+  for (int i = 0; args[i] != NULL; i++) {
+    if (strcmp(args[i], "|") == 0)
+      n++;
+  }
 
-  // left child
-  p1 = fork();
-  if (p1 < 0) {
-    perror("fork");
-    return 1;
+  char ***stages = malloc(n * sizeof(char **));
+  pid_t *pids = malloc(n * sizeof(pid_t));
+  int *in_fds = malloc(n * sizeof(int));
+  int *out_fds = malloc(n * sizeof(int));
+  struct arsh_proc_stats *stats = calloc(n, sizeof(struct arsh_proc_stats));
+  struct arsh_relay *relays = calloc(n, sizeof(struct arsh_relay));
+  struct builtin_stage *threads = calloc(n, sizeof(struct builtin_stage));
+  struct arsh_tee **tees = calloc(n, sizeof(struct arsh_tee *));
+  if (!stages || !pids || !in_fds || !out_fds || !stats || !relays ||
+      !threads || !tees) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
   }
 
-  if (p1 == 0) {
-    // child1
-    close(pipefd[0]);
-    dup2(pipefd[1], STDOUT_FILENO);
-    close(pipefd[1]);
+  // split at every top-level "|"
+  stages[0] = args;
+  n = 1;
+  for (int k; (k = scan_tokens(stages[n - 1], "|", 0)) != -1; n++) {
+    stages[n - 1][k] = NULL;
+    stages[n] = &stages[n - 1][k + 1];
+  }
 
-    if (execvp(args[0], args) == -1) {
-      perror("arsh: exec p1");
+  // @pin on the first stage spreads the whole pipeline over cores
+  const char *pin = NULL;
+  for (int j = 0; stages[0][j] != NULL && arsh_is_placement(stages[0][j]);
+       j++) {
+    if (strncmp(stages[0][j], "@pin", 4) == 0) {
+      pin = stages[0][j];
+      for (int k = j; stages[0][k] != NULL; k++)
+        stages[0][k] = stages[0][k + 1];
+      break;
     }
-    exit(EXIT_FAILURE);
   }
 
-  // right child
-  p2 = fork();
-  if (p2 < 0) {
-    perror("fork");
-    return 1;
+  // close-on-exec everywhere: each child dup2()s its own ends onto
+  // stdin/stdout and every other pipe end disappears at exec
+  in_fds[0] = -1;
+  out_fds[n - 1] = -1;
+  int edges = 0;
+  for (; edges < n - 1; edges++) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+      perror("arsh: pipe");
+      break;
+    }
+    out_fds[edges] = pipefd[1];
+
+    if (profile) {
+      int relayfd[2];
+      if (pipe2(relayfd, O_CLOEXEC) < 0) {
+        perror("arsh: pipe");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        break;
+      }
+      relays[edges].in_fd = pipefd[0];
+      relays[edges].out_fd = relayfd[1];
+      in_fds[edges + 1] = relayfd[0];
+    } else {
+      in_fds[edges + 1] = pipefd[0];
+    }
   }
 
-  if (p2 == 0) {
-    // child2
-    close(pipefd[1]);
-    dup2(pipefd[0], STDIN_FILENO);
-    close(pipefd[0]);
+  // a pipeline missing an edge would run the wrong commands together:
+  // run none of it
+  if (edges < n - 1) {
+    for (int i = 0; i < edges; i++) {
+      close(out_fds[i]);
+      close(in_fds[i + 1]);
+      if (profile) {
+        close(relays[i].in_fd);
+        close(relays[i].out_fd);
+      }
+    }
+    last_exit_status = 1;
+    goto out;
+  }
+
+  is_running_command = 1;
 
-    if (execvp(cmd2[0], cmd2) == -1) {
-      perror("arsh: exec p2");
+  // group stages are forked copies of the shell and would flush our
+  // buffered output a second time
+  fflush(stdout);
+  fflush(stderr);
+
+  for (int i = 0; i < n; i++) {
+    // a stage with > targets besides its pipe (or with several) writes
+    // into a tee relay that also feeds the next stage
+    if (arsh_tee_outputs(stages[i]) > (out_fds[i] == -1 ? 1 : 0)) {
+      int tee_fd;
+      tees[i] = arsh_tee_setup(stages[i], out_fds[i], &tee_fd);
+      if (tees[i] != NULL) {
+        out_fds[i] = tee_fd;
+        tees[i]->report |= profile;
+      }
+    }
+
+    // builtins become threads below instead of forked copies of the shell
+    threads[i].builtin = find_builtin(stages[i][0]);
+    if (threads[i].builtin >= 0) {
+      pids[i] = 0;
+      continue;
+    }
+
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      perror("fork");
+    } else if (pids[i] == 0) {
+      if (in_fds[i] != -1)
+        dup2(in_fds[i], STDIN_FILENO);
+      if (out_fds[i] != -1)
+        dup2(out_fds[i], STDOUT_FILENO);
+
+      if (pin != NULL)
+        arsh_placement_pin(pin, i);
+
+      // a group stage runs in this forked copy of the shell, which never
+      // execs: drop the other stages' pipe ends so they still see EOF
+      if (strcmp(stages[i][0], "(") == 0 || strcmp(stages[i][0], "{") == 0) {
+        for (int k = 0; k < n; k++) {
+          if (in_fds[k] != -1)
+            close(in_fds[k]);
+          if (out_fds[k] != -1)
+            close(out_fds[k]);
+          if (profile && k < n - 1) {
+            close(relays[k].in_fd);
+            close(relays[k].out_fd);
+          }
+        }
+        arsh_audit_init();
+        launch_group(stages[i]);
+        arsh_audit_flush();
+        fflush(stdout);
+        fflush(stderr);
+        _exit(last_exit_status);
+      }
+
+      arsh_placement_apply(stages[i]);
+      arsh_redirect(stages[i]);
+      arsh_procsub_prepare_child(stages[i]);
+      if (execvp(stages[i][0], stages[i]) == -1) {
+        perror("arsh: exec");
+      }
+      _exit(EXIT_FAILURE);
+    } else {
+      arsh_stats_track(pids[i], arsh_placement_command(stages[i]));
     }
-    exit(EXIT_FAILURE);
   }
 
-  // parent
-  close(pipefd[0]);
-  close(pipefd[1]);
+  // parent: drop the stage ends, relays and builtin threads own the rest
+  for (int i = 0; i < n; i++) {
+    if (threads[i].builtin >= 0)
+      continue;
+    if (in_fds[i] != -1)
+      close(in_fds[i]);
+    if (out_fds[i] != -1)
+      close(out_fds[i]);
+  }
+
+  int relays_started = 0;
+  if (profile) {
+    for (; relays_started < n - 1; relays_started++) {
+      if (arsh_relay_start(&relays[relays_started]) == -1)
+        break;
+    }
+    // without its relay an edge has to be torn down so stages see EOF
+    for (int i = relays_started; i < n - 1; i++) {
+      close(relays[i].in_fd);
+      close(relays[i].out_fd);
+    }
+  }
 
-  waitpid(p1, NULL, 0);
-  waitpid(p2, NULL, 0);
+  for (int i = 0; i < n; i++) {
+    if (tees[i] != NULL && arsh_tee_start(tees[i], 0) == -1)
+      tees[i] = NULL;
+  }
+
+  for (int i = 0; i < n; i++) {
+    struct builtin_stage *st = &threads[i];
+    if (st->builtin < 0)
+      continue;
+
+    st->args = stages[i];
+    st->in_fd = in_fds[i];
+    st->out_fd = out_fds[i];
+    builtin_stage_redirect(st);
+
+    int err = pthread_create(&st->thread, NULL, builtin_stage_main, st);
+    if (err != 0) {
+      fprintf(stderr, "arsh: builtin thread: %s\n", strerror(err));
+      if (st->in_fd != -1)
+        close(st->in_fd);
+      if (st->out_fd != -1)
+        close(st->out_fd);
+      st->builtin = -1;
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    // a stage that could not be reaped counts as failed
+    if (pids[i] > 0 && arsh_stats_wait(pids[i], NULL, 0, &stats[i]) == -1)
+      stats[i].status = EXIT_FAILURE << 8;
+  }
+  for (int i = 0; i < n; i++) {
+    if (threads[i].builtin >= 0) {
+      pthread_join(threads[i].thread, NULL);
+      stats[i].wall_ms = threads[i].wall_ms;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    if (tees[i] != NULL)
+      arsh_tee_finish(tees[i]);
+  }
+  for (int i = 0; i < relays_started; i++)
+    arsh_relay_join(&relays[i]);
+
+  // a builtin last stage has already set $? itself
+  if (pids[n - 1] > 0) {
+    int status = stats[n - 1].status;
+    if (WIFEXITED(status))
+      last_exit_status = WEXITSTATUS(status);
+    else if (WIFSIGNALED(status))
+      last_exit_status = 128 + WTERMSIG(status);
+  }
+
+  if (profile)
+    arsh_profile_report(stages, stats, relays, n);
 
   is_running_command = 0;
+
+out:
+  free(stages);
+  free(pids);
+  free(in_fds);
+  free(out_fds);
+  free(stats);
+  free(relays);
+  free(threads);
+  free(tees);
   return 1;
 }
 
+// pipe
+int arsh_launch_pipe(char **args, int pipe_pos) {
+  (void)pipe_pos; // every "|" is split by launch_stages
+  return launch_stages(args, 0);
+}
+
+static void free_args(char **args) {
+  for (int i = 0; args[i] != NULL; i++)
+    free(args[i]);
+  free(args);
+}
+
+// <(cmd), $((expr)), $VAR and wildcard expansion of a run of plain words;
+// NULL if an arithmetic expression fails
+static char **expand_words(char **words) {
+  // process substitution: start <(cmd) and >(cmd) first
+  char **sub_args = arsh_expand_procsubs(words);
+
+  // arithmetic reads variables itself, so it goes before $VAR
+  char **arith_args = arsh_expand_arith(sub_args);
+  free_args(sub_args);
+  if (arith_args == NULL)
+    return NULL;
+
+  char **env_args = arsh_expand_env_vars(arith_args);
+  free_args(arith_args);
+  char **expanded = arsh_expand_wildcards(env_args);
+  free_args(env_args);
+  return expanded;
+}
+
+// Expand a pipeline right before it runs. The bodies of ( ) and { }
+// groups are copied as they are: each command inside is expanded when
+// the group gets to it, after the commands before it have run. Returns
+// NULL if the expansion failed.
+static char **expand_pipeline(char **args) {
+  int cap = 64, n = 0;
+  char **out = malloc(cap * sizeof(char *));
+  if (!out) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int depth = 0, cmd_start = 1;
+  for (int i = 0; args[i] != NULL;) {
+    char **words = NULL;
+    int count = 1;
+
+    if (depth == 0 && strcmp(args[i], "(") != 0 &&
+        !(cmd_start && strcmp(args[i], "{") == 0)) {
+      // a run of top-level words, up to the next group; the tokenizer
+      // splits "(" inside $(( ... )) off too, so keep those in the run
+      int end = i;
+      int run_start = cmd_start;
+      int arith = 0;
+      while (args[end] != NULL &&
+             (arith > 0 || (strcmp(args[end], "(") != 0 &&
+                            !(run_start && strcmp(args[end], "{") == 0)))) {
+        char *expr = strstr(args[end], "$((");
+        if (arith > 0)
+          arith += arsh_paren_balance(args[end]);
+        else if (expr != NULL)
+          arith = arsh_paren_balance(expr);
+        run_start = starts_command(args[end]);
+        end++;
+      }
+      char *saved = args[end];
+      args[end] = NULL;
+      words = expand_words(&args[i]);
+      args[end] = saved;
+      if (words == NULL) {
+        out[n] = NULL;
+        free_args(out);
+        return NULL;
+      }
+      cmd_start = run_start;
+      count = end - i;
+    } else {
+      if (strcmp(args[i], "(") == 0 || (cmd_start && strcmp(args[i], "{") == 0))
+        depth++;
+      else if (strcmp(args[i], ")") == 0 ||
+               (cmd_start && strcmp(args[i], "}") == 0))
+        depth--;
+      cmd_start = starts_command(args[i]);
+    }
+
+    int added = 0;
+    if (words != NULL) {
+      while (words[added] != NULL)
+        added++;
+    } else {
+      added = 1;
+    }
+    while (n + added + 1 > cap) {
+      cap *= 2;
+      out = realloc(out, cap * sizeof(char *));
+      if (!out) {
+        fprintf(stderr, "arsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (words != NULL) {
+      memcpy(&out[n], words, added * sizeof(char *));
+      free(words);
+    } else {
+      out[n] = strdup(args[i]);
+    }
+    n += added;
+    i += count;
+  }
+
+  out[n] = NULL;
+  return out;
+}
+
+static int dispatch_pipeline(char **args);
+
 int arsh_launch_pipeline(char **args) {
   if (args[0] == NULL)
     return 1;
 
+  // time keyword: report resource usage of the whole pipeline
+  if (strcmp(args[0], "time") == 0) {
+    arsh_time_begin();
+    int status = arsh_launch_pipeline(&args[1]);
+    arsh_time_end();
+    return status;
+  }
+
+  // expand now, so earlier commands of the line are already visible;
+  // process substitutions start here and are reaped once this pipeline
+  // is done with them
+  int procsub_mark = arsh_procsub_mark();
+  char **expanded = expand_pipeline(args);
+  if (expanded == NULL) {
+    last_exit_status = 1;
+    arsh_procsub_finish(procsub_mark, 0);
+    return 1;
+  }
+
+  int count = 0;
+  while (expanded[count] != NULL)
+    count++;
+  int background = count > 0 && strcmp(expanded[count - 1], "&") == 0;
+
+  struct arsh_audit_cmd audit;
+  arsh_audit_begin(&audit, expanded);
+
+  int status = count > 0 ? dispatch_pipeline(expanded) : 1;
+  arsh_audit_end(&audit, last_exit_status);
+
+  arsh_procsub_finish(procsub_mark, background);
+  free_args(expanded);
+  return status;
+}
+
+static int dispatch_pipeline(char **args) {
+  // profile keyword: relay every pipeline edge and report where it stalls
+  if (strcmp(args[0], "profile") == 0) {
+    if (args[1] == NULL) {
+      fprintf(stderr, "arsh: expected pipeline after \"profile\"\n");
+      return 1;
+    }
+    return launch_stages(&args[1], 1);
+  }
+
+  // batch keyword: explicit xargs-style splitting of a simple command
+  if (strcmp(args[0], "batch") == 0) {
+    return arsh_batch_command(args);
+  }
+
   // scan pipe
-  for (int i = 0; args[i] != NULL; i++) {
-    if (strcmp(args[i], "|") == 0) {
-      if (args[i + 1] == NULL) {
-        fprintf(stderr, "arsh: pipe missing second command\n");
-        return 1;
-      }
-      return arsh_launch_pipe(args, i);
+  int pipe_pos = scan_tokens(args, "|", 0);
+  if (pipe_pos != -1) {
+    if (args[pipe_pos + 1] == NULL) {
+      fprintf(stderr, "arsh: pipe missing second command\n");
+      return 1;
     }
+    return arsh_launch_pipe(args, pipe_pos);
+  }
+
+  // ( subshell ) and { group; }
+  if (strcmp(args[0], "(") == 0 || strcmp(args[0], "{") == 0) {
+    return launch_group(args);
+  }
+
+  // NAME=value words on their own set a variable; like every other
+  // variable in arsh it lives in the environment
+  int assignments = 0;
+  while (args[assignments] != NULL && is_assignment(args[assignments]))
+    assignments++;
+  if (assignments > 0 && args[assignments] == NULL) {
+    arsh_scope_touch_env();
+    for (int i = 0; i < assignments; i++) {
+      char *equal_sign = strchr(args[i], '=');
+      *equal_sign = '\0';
+      if (setenv(args[i], equal_sign + 1, 1) != 0)
+        perror("arsh");
+    }
+    last_exit_status = 0;
+    return 1;
   }
 
   // check builtins
-  for (int i = 0; i < arsh_num_biultins(); i++) {
-    if (strcmp(args[0], builtin_str[i]) == 0) {
-      return (*builtin_func[i])(args);
+  int builtin = find_builtin(args[0]);
+  if (builtin >= 0) {
+    // echo x > a > b: the builtin writes into a tee relay, as a forked
+    // command would
+    if (arsh_tee_outputs(args) > 1) {
+      int tee_fd;
+      struct arsh_tee *tee = arsh_tee_setup(args, -1, &tee_fd);
+      if (tee == NULL) {
+        last_exit_status = 1;
+        return 1;
+      }
+      FILE *out = fdopen(tee_fd, "w");
+      if (out == NULL) {
+        perror("arsh: fdopen");
+        close(tee_fd);
+      }
+      if (arsh_tee_start(tee, 0) == -1) {
+        if (out != NULL)
+          fclose(out);
+        last_exit_status = 1;
+        return 1;
+      }
+
+      int status = 1;
+      if (out != NULL) {
+        arsh_set_thread_stdio(out, -1);
+        status = dispatch_pipeline(args);
+        arsh_set_thread_stdio(NULL, -1);
+        fclose(out);
+      } else {
+        last_exit_status = 1;
+      }
+      arsh_tee_finish(tee);
+      return status;
+    }
+
+    int redir = 1;
+    while (args[redir] != NULL && strcmp(args[redir], ">") != 0 &&
+           strcmp(args[redir], ">>") != 0 && strcmp(args[redir], "<") != 0)
+      redir++;
+    if (args[redir] == NULL)
+      return (*builtin_func[builtin])(args);
+
+    // redirect the shell's own fds around the builtin, then put them back
+    arsh_scope_push(0);
+    if (arsh_scope_redirect(&args[redir]) == 0) {
+      args[redir] = NULL;
+      (*builtin_func[builtin])(args);
+    } else {
+      last_exit_status = 1;
     }
+    arsh_scope_pop();
+    return 1;
+  }
+
+  // split argument lists that would overflow ARG_MAX
+  if (arsh_batch_needed(args)) {
+    return arsh_launch_batched(args, 1);
   }
 
   // normal launch
@@ -273,39 +982,38 @@ int arsh_execute(char **args) {
     return 1;
   }
 
-  // expand env
-  char **env_args = arsh_expand_env_vars(args);
-
-  // expand wildcards
-  char **expanded_args = arsh_expand_wildcards(env_args);
-
-  // cleanup snapshot
-  int env_count = 0;
-  while (env_args[env_count] != NULL) {
-    free(env_args[env_count]);
-    env_count++;
-  }
-  free(env_args);
-
   int count = 0;
-  while (expanded_args[count] != NULL)
+  while (args[count] != NULL)
     count++;
 
-  char **cleanup_list = malloc((count + 1) * sizeof(char *));
-  for (int i = 0; i < count; i++) {
-    cleanup_list[i] = expanded_args[i];
+  // ;, && and || cut the array into pieces, so hand them a copy of it and
+  // leave the caller's words intact; <(cmd), $((expr)), $VAR and wildcards
+  // are expanded per pipeline as it runs
+  char **line = malloc((count + 1) * sizeof(char *));
+  if (!line) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
   }
-  cleanup_list[count] = NULL;
+  memcpy(line, args, (count + 1) * sizeof(char *));
 
-  int status = arsh_logic_split(expanded_args);
+  int status = arsh_logic_split(line);
 
-  // clean-up
-  for (int i = 0; i < count; i++) {
-    free(cleanup_list[i]);
-  }
+  free(line);
+  return status;
+}
 
-  free(cleanup_list);
-  free(expanded_args);
+int arsh_execute_line(char *line) {
+  char **args = arsh_split_line(line);
+  int status = arsh_execute(args);
+
+  int i = 0;
+  if (args != NULL) {
+    while (args[i] != NULL) {
+      free(args[i]);
+      i++;
+    }
+    free(args);
+  }
 
   return status;
 }
@@ -0,0 +1,559 @@
+#define _GNU_SOURCE
+
+#include "../include/highlight.h"
+#include "../include/builtins.h"
+#include "../include/placement.h"
+#include "../include/shell.h"
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+// Live highlighting for the line editor. Every keystroke re-lexes only from
+// the start of the edited token until the lexer state settles back into
+// the previous run, command words are looked up in a table of $PATH built
+// once per change of $PATH, and the redraw writes just the terminal cells
+// that differ from what is on screen, in a single write.
+
+enum {
+  HL_DEFAULT,
+  HL_COMMAND,  // found on $PATH
+  HL_BUILTIN,
+  HL_KEYWORD,  // time, profile, batch, { } and placement prefixes
+  HL_MISSING,  // command not found
+  HL_OPERATOR,
+  HL_QUOTE,
+  HL_VAR,
+};
+
+// colour of each style, indexed by the enum above
+static const char *sgr[] = {"\033[0m",    "\033[0;32m", "\033[0;36m",
+                            "\033[0;34m", "\033[0;31m", "\033[1;33m",
+                            "\033[0;33m", "\033[0;35m"};
+
+// ---- command lookup ----
+
+// open-addressed set of the executable names on $PATH
+static char **commands = NULL;
+static size_t commands_cap = 0;
+static size_t commands_count = 0;
+static char *commands_path = NULL; // $PATH the table was built from
+static struct timespec *dir_mtimes = NULL;
+static int dir_count = 0;
+
+static size_t hash_name(const char *name, size_t len) {
+  size_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)name[i]) * 1099511628211ULL;
+  return h;
+}
+
+static int has_command(const char *name, size_t len) {
+  if (commands_cap == 0)
+    return 0;
+  size_t i = hash_name(name, len) & (commands_cap - 1);
+  while (commands[i] != NULL) {
+    if (strncmp(commands[i], name, len) == 0 && commands[i][len] == '\0')
+      return 1;
+    i = (i + 1) & (commands_cap - 1);
+  }
+  return 0;
+}
+
+static void insert_command(char *name);
+
+static void grow_commands() {
+  char **old = commands;
+  size_t old_cap = commands_cap;
+  commands_cap = old_cap ? old_cap * 2 : 1024;
+  commands = calloc(commands_cap, sizeof(char *));
+  if (!commands) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  commands_count = 0;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i] != NULL)
+      insert_command(old[i]);
+  }
+  free(old);
+}
+
+// takes ownership of name
+static void insert_command(char *name) {
+  if ((commands_count + 1) * 2 > commands_cap)
+    grow_commands();
+  size_t len = strlen(name);
+  size_t i = hash_name(name, len) & (commands_cap - 1);
+  while (commands[i] != NULL) {
+    if (strcmp(commands[i], name) == 0) {
+      free(name);
+      return;
+    }
+    i = (i + 1) & (commands_cap - 1);
+  }
+  commands[i] = name;
+  commands_count++;
+}
+
+// stat every $PATH directory; returns 1 if one changed since the last scan
+static int path_dirs_changed(const char *path, int record) {
+  int changed = 0, n = 0;
+  const char *p = path;
+  while (1) {
+    size_t len = strcspn(p, ":");
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", (int)len, len ? p : ".");
+
+    struct stat st;
+    struct timespec mtime = {0, 0};
+    if (stat(dir, &st) == 0)
+      mtime = st.st_mtim;
+
+    if (record) {
+      struct timespec *grown = realloc(dir_mtimes, (n + 1) * sizeof(*grown));
+      if (!grown) {
+        fprintf(stderr, "arsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+      dir_mtimes = grown;
+      dir_mtimes[n] = mtime;
+    } else if (n >= dir_count || dir_mtimes[n].tv_sec != mtime.tv_sec ||
+               dir_mtimes[n].tv_nsec != mtime.tv_nsec) {
+      changed = 1;
+    }
+    n++;
+
+    if (p[len] == '\0')
+      break;
+    p += len + 1;
+  }
+  if (record)
+    dir_count = n;
+  return changed || n != dir_count;
+}
+
+static void scan_dir(const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    if (entry->d_type == DT_DIR)
+      continue;
+    if (faccessat(dirfd(d), entry->d_name, X_OK, 0) != 0)
+      continue;
+    char *name = strdup(entry->d_name);
+    if (!name) {
+      fprintf(stderr, "arsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    insert_command(name);
+  }
+  closedir(d);
+}
+
+// rebuild the table when $PATH or one of its directories changed; called
+// once per prompt, so typing never touches the filesystem for bare names
+static void refresh_commands() {
+  const char *path = getenv("PATH");
+  if (path == NULL)
+    path = "";
+  if (commands_path && strcmp(commands_path, path) == 0 &&
+      !path_dirs_changed(path, 0))
+    return;
+
+  for (size_t i = 0; i < commands_cap; i++) {
+    free(commands[i]);
+    commands[i] = NULL;
+  }
+  commands_count = 0;
+  free(commands_path);
+  commands_path = strdup(path);
+  if (!commands_path) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  path_dirs_changed(path, 1);
+  const char *p = path;
+  while (1) {
+    size_t len = strcspn(p, ":");
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", (int)len, len ? p : ".");
+    scan_dir(dir);
+    if (p[len] == '\0')
+      break;
+    p += len + 1;
+  }
+}
+
+// words with a slash are checked on disk, remembering the last answer so
+// moving the cursor around does not repeat the access()
+static int is_executable_path(const char *word) {
+  static char last[PATH_MAX];
+  static int last_ok = 0;
+  if (strcmp(last, word) == 0)
+    return last_ok;
+  snprintf(last, sizeof(last), "%s", word);
+  last_ok = access(word, X_OK) == 0;
+  return last_ok;
+}
+
+// style of a word in command position; *keep is set when the next word is
+// still in command position (time ls, @nice=5 make)
+static int classify_command(const char *w, int n, int *keep) {
+  char word[256];
+  int k = 0;
+  *keep = 0;
+  for (int i = 0; i < n; i++) {
+    if (w[i] == '$')
+      return HL_DEFAULT; // only known when it runs
+    if (w[i] != '"' && k < (int)sizeof(word) - 1)
+      word[k++] = w[i];
+  }
+  word[k] = '\0';
+  if (k == 0)
+    return HL_DEFAULT;
+
+  static const char *keywords[] = {"time", "profile", "batch", "{", "}"};
+  for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+    if (strcmp(word, keywords[i]) == 0) {
+      *keep = 1;
+      return HL_KEYWORD;
+    }
+  }
+  if (arsh_is_placement(word)) {
+    *keep = 1;
+    return HL_KEYWORD;
+  }
+
+  for (int i = 0; i < arsh_num_biultins(); i++) {
+    if (strcmp(word, builtin_str[i]) == 0)
+      return HL_BUILTIN;
+  }
+  if (strchr(word, '/'))
+    return is_executable_path(word) ? HL_COMMAND : HL_MISSING;
+  return has_command(word, k) ? HL_COMMAND : HL_MISSING;
+}
+
+// ---- incremental lexer ----
+
+static void finish_word(struct arsh_hl *hl, const char *buf, int start,
+                        int end, int word_cmd, struct arsh_hl_state *s) {
+  static const char *ops[] = {"|", "||", "&&", "&", ">", ">>", "<"};
+  const char *w = buf + start;
+  int n = end - start;
+
+  int op = -1;
+  for (int i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+    if ((int)strlen(ops[i]) == n && strncmp(w, ops[i], n) == 0)
+      op = i;
+  }
+
+  if (op != -1) {
+    memset(hl->styles + start, HL_OPERATOR, n);
+    if (ops[op][0] == '<' || ops[op][0] == '>') {
+      s->after_redir = 1;
+    } else {
+      s->expect_cmd = 1;
+      s->after_redir = 0;
+    }
+  } else if (s->after_redir) {
+    s->after_redir = 0; // a file name
+  } else if (word_cmd) {
+    int keep;
+    int style = classify_command(w, n, &keep);
+    for (int i = start; i < end; i++) {
+      if (hl->styles[i] == HL_DEFAULT)
+        hl->styles[i] = style;
+    }
+    s->expect_cmd = keep;
+  }
+
+  s->in_word = 0;
+  s->var = 0;
+  s->arith = 0;
+  s->wparen = 0;
+}
+
+// style of byte c inside a word
+static int word_char(char c, struct arsh_hl_state *s) {
+  if (s->quote) {
+    if (c == '"')
+      s->quote = 0;
+    return HL_QUOTE;
+  }
+  if (s->arith) {
+    if (c == '(')
+      s->arith++;
+    else if (c == ')')
+      s->arith--;
+    return HL_VAR;
+  }
+
+  if (s->var == 1) { // just after $
+    s->var = 0;
+    if (c == '?')
+      return HL_VAR;
+    if (c == '(') {
+      s->var = 3;
+      return HL_VAR;
+    }
+    if (isalpha((unsigned char)c) || c == '_') {
+      s->var = 2;
+      return HL_VAR;
+    }
+  } else if (s->var == 2) { // in the name
+    if (isalnum((unsigned char)c) || c == '_')
+      return HL_VAR;
+    s->var = 0;
+  } else if (s->var == 3) { // after $(
+    s->var = 0;
+    if (c == '(') {
+      s->arith = 2;
+      return HL_VAR;
+    }
+    s->wparen++;
+  }
+
+  if (c == '"') {
+    s->quote = 1;
+    return HL_QUOTE;
+  }
+  if (c == '$') {
+    s->var = 1;
+    return HL_VAR;
+  }
+  if (c == '(')
+    s->wparen++;
+  else if (c == ')')
+    s->wparen--;
+  return HL_DEFAULT;
+}
+
+// Lex from the token boundary start onwards. Once past settle, reaching a
+// boundary in the same state as the previous run means the rest of the
+// line lexes exactly as before, so stop there.
+static void lex(struct arsh_hl *hl, const char *buf, int len, int start,
+                int settle) {
+  struct arsh_hl_state s = hl->states[start];
+  int word_start = start, word_cmd = 0;
+
+  for (int i = start;; i++) {
+    if (i > start && i >= settle && !s.in_word &&
+        memcmp(&s, &hl->states[i], sizeof(s)) == 0)
+      break;
+    hl->states[i] = s;
+    if (i == len) {
+      if (s.in_word)
+        finish_word(hl, buf, word_start, len, word_cmd, &s);
+      break;
+    }
+
+    char c = buf[i];
+    if (s.in_word && !s.quote && !s.arith &&
+        (isspace((unsigned char)c) || c == ';' || (c == ')' && !s.wparen)))
+      finish_word(hl, buf, word_start, i, word_cmd, &s);
+
+    if (!s.in_word) {
+      if (isspace((unsigned char)c)) {
+        hl->styles[i] = HL_DEFAULT;
+        continue;
+      }
+      // the tokenizer splits these off even without spaces
+      if (c == ';' || c == '(' || c == ')') {
+        hl->styles[i] = HL_OPERATOR;
+        s.expect_cmd = c != ')';
+        s.after_redir = 0;
+        continue;
+      }
+      s.in_word = 1;
+      word_start = i;
+      word_cmd = s.expect_cmd && !s.after_redir;
+    }
+    hl->styles[i] = word_char(c, &s);
+  }
+  hl->len = len;
+}
+
+static int terminal_cols() {
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+    return ws.ws_col;
+  return 80;
+}
+
+static void reserve(struct arsh_hl *hl, int len) {
+  if (len + 1 <= hl->cap)
+    return;
+  int cap = hl->cap ? hl->cap : 1024;
+  while (cap < len + 1)
+    cap *= 2;
+
+  struct arsh_hl_state *states = realloc(hl->states, cap * sizeof(*states));
+  unsigned char *styles = realloc(hl->styles, cap);
+  char *shown = realloc(hl->shown, cap);
+  unsigned char *shown_styles = realloc(hl->shown_styles, cap);
+  if (!states || !styles || !shown || !shown_styles) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  hl->states = states;
+  hl->styles = styles;
+  hl->shown = shown;
+  hl->shown_styles = shown_styles;
+  hl->cap = cap;
+}
+
+// start a new line right after a prompt prompt_width cells wide
+void arsh_hl_begin(struct arsh_hl *hl, int prompt_width) {
+  reserve(hl, 0);
+  refresh_commands();
+  memset(&hl->states[0], 0, sizeof(hl->states[0]));
+  hl->states[0].expect_cmd = 1;
+  hl->len = 0;
+  hl->shown_len = 0;
+  hl->cursor = 0;
+  hl->prompt_width = prompt_width;
+
+  // a prompt that exactly fills its last row leaves the terminal waiting to
+  // wrap; push the cursor onto the next row so the cell maths holds
+  if (prompt_width > 0 && prompt_width % terminal_cols() == 0) {
+    ssize_t n = write(STDOUT_FILENO, " \r", 2);
+    (void)n;
+  }
+}
+
+// the removed bytes at pos were replaced by inserted new ones
+void arsh_hl_edit(struct arsh_hl *hl, const char *buf, int len, int pos,
+                  int removed, int inserted) {
+  reserve(hl, len);
+  int old_len = hl->len;
+
+  // restart at the beginning of the token the edit touches
+  int start = pos;
+  while (start > 0 && hl->states[start].in_word)
+    start--;
+  struct arsh_hl_state restart = hl->states[start];
+
+  // keep the old states and styles of the tail lined up with their bytes,
+  // so the lexer can tell when it is back in step with them
+  memmove(hl->states + pos + inserted, hl->states + pos + removed,
+          (old_len - pos - removed + 1) * sizeof(hl->states[0]));
+  memmove(hl->styles + pos + inserted, hl->styles + pos + removed,
+          old_len - pos - removed);
+
+  hl->states[start] = restart;
+  lex(hl, buf, len, start, pos + inserted);
+}
+
+// ---- redraw ----
+
+struct out {
+  char *data;
+  size_t len, cap;
+};
+
+static void put(struct out *o, const char *s, size_t n) {
+  if (o->len + n > o->cap) {
+    size_t cap = o->cap ? o->cap * 2 : 4096;
+    while (cap < o->len + n)
+      cap *= 2;
+    char *data = realloc(o->data, cap);
+    if (!data) {
+      fprintf(stderr, "arsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    o->data = data;
+    o->cap = cap;
+  }
+  memcpy(o->data + o->len, s, n);
+  o->len += n;
+}
+
+static void put_move(struct out *o, const char *fmt, int n) {
+  char seq[16];
+  int len = snprintf(seq, sizeof(seq), fmt, n);
+  put(o, seq, len);
+}
+
+// move the terminal cursor between byte positions of a wrapped line
+static void move_cursor(struct out *o, int from, int to, int prompt_width,
+                        int cols) {
+  int from_row = (prompt_width + from) / cols;
+  int from_col = (prompt_width + from) % cols;
+  int to_row = (prompt_width + to) / cols;
+  int to_col = (prompt_width + to) % cols;
+
+  if (to_row < from_row)
+    put_move(o, "\033[%dA", from_row - to_row);
+  else if (to_row > from_row)
+    put_move(o, "\033[%dB", to_row - from_row);
+  if (to_col > from_col)
+    put_move(o, "\033[%dC", to_col - from_col);
+  else if (to_col < from_col)
+    put_move(o, "\033[%dD", from_col - to_col);
+}
+
+// bring the screen up to date with buf and put the cursor at position
+void arsh_hl_refresh(struct arsh_hl *hl, const char *buf, int len,
+                     int position) {
+  static struct out o;
+  int cols = terminal_cols();
+  o.len = 0;
+
+  int first = 0;
+  int common = len < hl->shown_len ? len : hl->shown_len;
+  while (first < common && hl->shown[first] == buf[first] &&
+         hl->shown_styles[first] == hl->styles[first])
+    first++;
+
+  // cells only line up again after the change when the length is the same
+  int last = len;
+  if (len == hl->shown_len) {
+    while (last > first && hl->shown[last - 1] == buf[last - 1] &&
+           hl->shown_styles[last - 1] == hl->styles[last - 1])
+      last--;
+  }
+
+  if (first < last) {
+    move_cursor(&o, hl->cursor, first, hl->prompt_width, cols);
+    int style = HL_DEFAULT; // every redraw leaves the default colours on
+    for (int i = first; i < last; i++) {
+      if (hl->styles[i] != style) {
+        style = hl->styles[i];
+        put(&o, sgr[style], strlen(sgr[style]));
+      }
+      put(&o, &buf[i], 1);
+      // step onto the next row now instead of leaving the terminal in its
+      // pending-wrap state, which cursor movement would get wrong
+      if ((hl->prompt_width + i + 1) % cols == 0)
+        put(&o, "\r\n", 2);
+    }
+    if (style != HL_DEFAULT)
+      put(&o, sgr[HL_DEFAULT], strlen(sgr[HL_DEFAULT]));
+    hl->cursor = last;
+  }
+
+  if (hl->shown_len > len) {
+    move_cursor(&o, hl->cursor, len, hl->prompt_width, cols);
+    put(&o, "\033[J", 3);
+    hl->cursor = len;
+  }
+
+  move_cursor(&o, hl->cursor, position, hl->prompt_width, cols);
+  hl->cursor = position;
+
+  memcpy(hl->shown, buf, len);
+  memcpy(hl->shown_styles, hl->styles, len);
+  hl->shown_len = len;
+
+  for (size_t off = 0; off < o.len;) {
+    ssize_t n = write(STDOUT_FILENO, o.data + off, o.len - off);
+    if (n <= 0)
+      break;
+    off += n;
+  }
+}
@@ -1,4 +1,5 @@
 #include "../include/input.h"
+#include "../include/highlight.h"
 #include "../include/shell.h"
 
 struct termios orig_termios;
@@ -33,6 +34,35 @@ void add_to_history(char *line) {
 }
 
 #define arsh_RL_BUFSIZE 1024
+
+static struct arsh_hl hl;
+static int prompt_width = 0;
+
+// make room for len bytes plus the terminator
+static char *reserve_line(char *buffer, int *bufsize, int len) {
+  if (len + 1 <= *bufsize)
+    return buffer;
+  while (*bufsize < len + 1)
+    *bufsize *= 2;
+  buffer = realloc(buffer, *bufsize);
+  if (!buffer) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  return buffer;
+}
+
+// swap the whole line for text, e.g. a history entry
+static char *replace_line(char *buffer, int *bufsize, int *len,
+                          const char *text) {
+  int old_len = *len;
+  *len = strlen(text);
+  buffer = reserve_line(buffer, bufsize, *len);
+  memcpy(buffer, text, *len + 1);
+  arsh_hl_edit(&hl, buffer, *len, 0, old_len, *len);
+  return buffer;
+}
+
 char *arsh_read_line(FILE *stream) {
   if (stream != stdin) {
     char *line = NULL;
@@ -47,18 +77,34 @@ char *arsh_read_line(FILE *stream) {
 
   int bufsize = arsh_RL_BUFSIZE;
   int position = 0;
+  int len = 0;
   char *buffer = malloc(sizeof(char) * bufsize);
+  if (!buffer) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
   buffer[0] = '\0';
   int history_index = history_count;
+  line_interrupted = 0;
+  arsh_hl_begin(&hl, prompt_width);
 
   while (1) {
     char c;
     if (read(STDIN_FILENO, &c, 1) <= 0)
       break; // EOF
 
+    // Ctrl+C printed a fresh prompt: start over on it
+    if (line_interrupted) {
+      line_interrupted = 0;
+      len = position = 0;
+      buffer[0] = '\0';
+      history_index = history_count;
+      arsh_hl_begin(&hl, prompt_width);
+    }
+
     // Ctrl+D (EOT)
     if (c == 4) {
-      if (strlen(buffer) == 0) {
+      if (len == 0) {
         free(buffer);
         disableRawMode();
         return NULL;
@@ -74,6 +120,10 @@ char *arsh_read_line(FILE *stream) {
         continue;
       if (read(STDIN_FILENO, &seq[1], 1) == 0)
         continue;
+      // \x1b[1~ style keys end in a tilde
+      if (seq[0] == '[' && isdigit((unsigned char)seq[1]) &&
+          read(STDIN_FILENO, &seq[2], 1) == 0)
+        continue;
 
       if (seq[0] == '[') {
         // arrow keys
@@ -81,95 +131,58 @@ char *arsh_read_line(FILE *stream) {
           // UP
           if (history_index > 0) {
             history_index--;
-
-            while (position > 0) {
-              printf("\b \b");
-              fflush(stdout);
-              position--;
-            }
-
-            strcpy(buffer, history[history_index]);
-            position = strlen(buffer);
-            printf("%s", buffer);
-            fflush(stdout);
+            buffer = replace_line(buffer, &bufsize, &len,
+                                  history[history_index]);
+            position = len;
           }
         } else if (seq[1] == 'B') {
           // DOWN
           if (history_index < history_count) {
             history_index++;
-
-            while (position > 0) {
-              printf("\b \b");
-              fflush(stdout);
-              position--;
-            }
-
-            if (history_index < history_count) {
-              strcpy(buffer, history[history_index]);
-              position = strlen(buffer);
-              printf("%s", buffer);
-              fflush(stdout);
-            } else {
-              buffer[0] = '\0';
-              position = 0;
-            }
+            buffer = replace_line(buffer, &bufsize, &len,
+                                  history_index < history_count
+                                      ? history[history_index]
+                                      : "");
+            position = len;
           }
         } else if (seq[1] == 'C') {
           // RIGHT
-          if (position < (int)strlen(buffer)) {
-            printf("\033[C");
-            fflush(stdout);
+          if (position < len)
             position++;
-          }
         } else if (seq[1] == 'D') {
           // LEFT
-          if (position > 0) {
-            printf("\033[D");
-            fflush(stdout);
+          if (position > 0)
             position--;
-          }
         }
         // HOME KEY (Standard: \x1b[H or \x1b[1~)
         else if (seq[1] == 'H' || seq[1] == '1') {
-          while (position > 0) {
-            printf("\b");
-            fflush(stdout);
-            position--;
-          }
+          position = 0;
         }
         // END KEY (Standard: \x1b[F or \x1b[4~)
         else if (seq[1] == 'F' || seq[1] == '4') {
-          int len = strlen(buffer);
-          while (position < len) {
-            printf("\033[C");
-            fflush(stdout);
-            position++;
-          }
+          position = len;
+        }
+        // DELETE KEY (\x1b[3~)
+        else if (seq[1] == '3' && position < len) {
+          memmove(&buffer[position], &buffer[position + 1], len - position);
+          len--;
+          arsh_hl_edit(&hl, buffer, len, position, 1, 0);
         }
       }
       // Some terminals use 'O' for Home/End (e.g. \x1bOH)
       else if (seq[0] == 'O') {
-        if (seq[1] == 'H') {
-          while (position > 0) {
-            printf("\b");
-            fflush(stdout);
-            position--;
-          }
-        } else if (seq[1] == 'F') {
-          int len = strlen(buffer);
-          while (position < len) {
-            printf("\033[C");
-            fflush(stdout);
-            position++;
-          }
-        }
+        if (seq[1] == 'H')
+          position = 0;
+        else if (seq[1] == 'F')
+          position = len;
       }
+      arsh_hl_refresh(&hl, buffer, len, position);
       continue;
     }
 
     // normal keys
     if (c == '\n') {
-      buffer[strlen(buffer)] = '\0';
+      arsh_hl_refresh(&hl, buffer, len, len);
       printf("\n");
       fflush(stdout);
       disableRawMode();
@@ -177,50 +190,23 @@ char *arsh_read_line(FILE *stream) {
       return buffer;
     } else if (c == 127) {
       if (position > 0) {
-        int len = strlen(buffer);
-        if (position == len) {
-          position--;
-          buffer[position] = '\0';
-          printf("\b \b");
-          fflush(stdout);
-        } else {
-          memmove(&buffer[position - 1], &buffer[position], len - position + 1);
-          position--;
-
-          // redraw
-          printf("\b");
-          printf("%s", &buffer[position]);
-          printf(" ");
-          fflush(stdout);
-
-          for (int k = position; k < len; k++) {
-            printf("\b");
-            fflush(stdout);
-          }
-        }
+        memmove(&buffer[position - 1], &buffer[position], len - position + 1);
+        position--;
+        len--;
+        arsh_hl_edit(&hl, buffer, len, position, 1, 0);
+        arsh_hl_refresh(&hl, buffer, len, position);
       }
     } else if (c == '\t') {
       // tabs(future feature)
     } else if (isprint(c)) {
       // regular char
-      int len = strlen(buffer);
-      if (position == len) {
-        buffer[position] = c;
-        buffer[position + 1] = '\0';
-        position++;
-        printf("%c", c);
-        fflush(stdout);
-      } else {
-        memmove(&buffer[position + 1], &buffer[position], len - position + 1);
-        buffer[position] = c;
-        printf("%s", &buffer[position]);
-        fflush(stdout);
-        position++;
-        for (int k = position; k <= len; k++) {
-          printf("\b");
-          fflush(stdout);
-        }
-      }
+      buffer = reserve_line(buffer, &bufsize, len + 1);
+      memmove(&buffer[position + 1], &buffer[position], len - position + 1);
+      buffer[position] = c;
+      len++;
+      arsh_hl_edit(&hl, buffer, len, position, 0, 1);
+      position++;
+      arsh_hl_refresh(&hl, buffer, len, position);
     }
   }
 
@@ -229,6 +215,24 @@ char *arsh_read_line(FILE *stream) {
   return NULL;
 }
 
+// cells a string takes on screen, skipping colour escapes and counting a
+// UTF-8 sequence once
+static int visible_width(const char *s) {
+  int width = 0;
+  for (const char *p = s; *p; p++) {
+    if (*p == '\033' && p[1] == '[') {
+      p += 2;
+      while (*p && !isalpha((unsigned char)*p))
+        p++;
+      if (!*p)
+        break;
+    } else if (((unsigned char)*p & 0xC0) != 0x80) {
+      width++;
+    }
+  }
+  return width;
+}
+
 void arsh_print_prompt() {
   char hostname[1024];
   gethostname(hostname, 1024);
@@ -236,12 +240,16 @@ void arsh_print_prompt() {
   char *username = getenv("USER");
 
   char cwd[PATH_MAX];
+  char prompt[sizeof(hostname) + PATH_MAX + 64];
   if (getcwd(cwd, sizeof(cwd)) != NULL) {
-    printf("\033[1;32m%s@%s\033[0m:\033[1;34m%s\033[0m$ ",
-           username ? username : "user", hostname, cwd);
+    snprintf(prompt, sizeof(prompt),
+             "\033[1;32m%s@%s\033[0m:\033[1;34m%s\033[0m$ ",
+             username ? username : "user", hostname, cwd);
   } else {
-    printf("> ");
+    snprintf(prompt, sizeof(prompt), "> ");
   }
+  printf("%s", prompt);
+  prompt_width = visible_width(prompt);
 
   fflush(stdout);
 }
@@ -1,11 +1,16 @@
+#include "../include/audit.h"
 #include "../include/executor.h"
 #include "../include/input.h"
+#include "../include/parallel.h"
 #include "../include/parser.h"
+#include "../include/server.h"
 #include "../include/shell.h"
+#include "../include/stats.h"
 #include <stdio.h>
 
 // Global variables definition
 volatile sig_atomic_t is_running_command = 0;
+volatile sig_atomic_t line_interrupted = 0;
 int last_exit_status = 0;
 char *history[HISTORY_MAX];
 int history_count = 0;
@@ -15,6 +20,7 @@ void sigint_handler(int signo) {
   (void)signo; // unused
   if (!is_running_command) {
     printf("\n");
+    line_interrupted = 1;
     arsh_print_prompt();
     fflush(stdout);
   } else {
@@ -24,14 +30,14 @@ void sigint_handler(int signo) {
 
 void arsh_loop(FILE *stream) {
   char *line;
-  char **args;
   int status;
 
   do {
     // Zombie Reaper
     int zombie_status;
     pid_t zombie_pid;
-    while ((zombie_pid = waitpid(-1, &zombie_status, WNOHANG)) > 0) {
+    while ((zombie_pid = arsh_stats_wait(-1, &zombie_status, WNOHANG,
+                                         NULL)) > 0) {
       printf("[Process %d exited]\n", zombie_pid);
     }
 
@@ -45,20 +51,9 @@ void arsh_loop(FILE *stream) {
       exit(EXIT_SUCCESS);
     }
 
-    args = arsh_split_line(line);
-    status = arsh_execute(args);
-
+    status = arsh_execute_line(line);
     free(line);
 
-    int i = 0;
-    if (args != NULL) {
-      while (args[i] != NULL) {
-        free(args[i]);
-        i++;
-      }
-      free(args);
-    }
-
   } while (status);
 }
 
@@ -93,6 +88,18 @@ int main(int argc, char **argv) {
     perror("arsh: signal");
   }
 
+  if (argc == 3 && strcmp(argv[1], "--server") == 0) {
+    return arsh_server(argv[2]);
+  }
+  if (argc == 5 && strcmp(argv[1], "--client") == 0 &&
+      strcmp(argv[3], "-c") == 0) {
+    return arsh_client(argv[2], ARSH_REQ_COMMAND, argv[4]);
+  }
+  if (argc == 4 && strcmp(argv[1], "--client") == 0) {
+    return arsh_client(argv[2], ARSH_REQ_SCRIPT, argv[3]);
+  }
+
+  arsh_audit_init();
   print_banner();
 
   if (argc == 1) {
@@ -105,8 +112,21 @@ int main(int argc, char **argv) {
     }
     arsh_loop(f);
     fclose(f);
+  } else if (argc == 4 && strcmp(argv[1], "-j") == 0 && atoi(argv[2]) > 0) {
+    FILE *f = fopen(argv[3], "r");
+    if (!f) {
+      perror("arsh");
+      return EXIT_FAILURE;
+    }
+    int status = arsh_run_parallel(f, atoi(argv[2]));
+    fclose(f);
+    return status;
   } else {
     fprintf(stderr, "Usage: %s [script_file]\n", argv[0]);
+    fprintf(stderr, "       %s -j jobs script_file\n", argv[0]);
+    fprintf(stderr, "       %s --server socket_path\n", argv[0]);
+    fprintf(stderr, "       %s --client socket_path (script_file | -c command)\n",
+            argv[0]);
   }
 
   return EXIT_SUCCESS;
@@ -0,0 +1,411 @@
+#include "../include/parallel.h"
+#include "../include/audit.h"
+#include "../include/executor.h"
+#include "../include/parser.h"
+#include "../include/placement.h"
+#include "../include/shell.h"
+#include "../include/stats.h"
+#include <errno.h>
+#include <poll.h>
+
+// Script lines become tasks. A task depends on the last barrier before it
+// plus whatever a preceding "#@task NAME after DEP..." annotation lists.
+// "wait" on its own line is a barrier, and so is any line with a command
+// that changes shell state (cd, export, unset, let, read, NAME=value, exit,
+// an assigning $((...))): those run in the shell itself once everything
+// before them has finished.
+
+enum task_state { TASK_PENDING, TASK_RUNNING, TASK_DONE };
+
+struct task {
+  char *line;
+  int lineno;
+  char *name;
+  int *deps;
+  int ndeps;
+  int in_shell; // barrier that runs in the shell process
+  int barrier;
+  enum task_state state;
+  pid_t pid;
+  int fd;
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  int status;
+};
+
+static struct task *tasks = NULL;
+static int ntasks = 0;
+
+static char *trim(char *s) {
+  while (isspace((unsigned char)*s))
+    s++;
+  char *end = s + strlen(s);
+  while (end > s && isspace((unsigned char)end[-1]))
+    *--end = '\0';
+  return s;
+}
+
+static int find_task(const char *name) {
+  for (int i = ntasks - 1; i >= 0; i--) {
+    if (tasks[i].name != NULL && strcmp(tasks[i].name, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static void add_dep(struct task *t, int dep) {
+  t->deps = realloc(t->deps, (t->ndeps + 1) * sizeof(int));
+  if (!t->deps) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  t->deps[t->ndeps++] = dep;
+}
+
+// commands that change the shell they run in; a task would change only
+// its own forked copy
+static const char *state_builtins[] = {"cd",   "export", "unset", "exit",
+                                       "let",  "read",   "source", "."};
+
+// an assignment inside arithmetic, e.g. the n=1 of $((n=1)) or n++
+static int arith_assigns(const char *word) {
+  for (const char *p = word; *p; p++) {
+    if ((p[0] == '+' && p[1] == '+') || (p[0] == '-' && p[1] == '-'))
+      return 1;
+    if (*p == '=' && p[1] != '=' && (p == word || !strchr("=!<>", p[-1])))
+      return 1;
+  }
+  return 0;
+}
+
+// the line is split like the executor splits it, and every command in it
+// is checked: the first word and each one after ; && || | & or a group
+// opener, past any time or placement prefix
+static int changes_shell_state(const char *line) {
+  char *copy = strdup(line);
+  char **args = arsh_split_line(copy);
+  int result = 0;
+  int command = 1;
+  int arith = 0; // paren depth inside a $((...)) that spans words
+
+  for (int i = 0; args[i] != NULL && !result; i++) {
+    const char *word = args[i];
+    const char *expr = strstr(word, "$((");
+    if (arith > 0) {
+      result = arith_assigns(word);
+      arith += arsh_paren_balance(word);
+      command = 0;
+    } else if (expr != NULL) {
+      result = arith_assigns(expr + 3);
+      arith = arsh_paren_balance(expr);
+      command = 0;
+    } else if (strcmp(word, ";") == 0 || strcmp(word, "&&") == 0 ||
+               strcmp(word, "||") == 0 || strcmp(word, "|") == 0 ||
+               strcmp(word, "&") == 0 || strcmp(word, "(") == 0 ||
+               strcmp(word, "{") == 0) {
+      command = 1;
+    } else if (command) {
+      if (strcmp(word, "time") == 0 || arsh_is_placement(word))
+        continue;
+      for (size_t k = 0;
+           k < sizeof(state_builtins) / sizeof(state_builtins[0]); k++) {
+        if (strcmp(word, state_builtins[k]) == 0)
+          result = 1;
+      }
+      if (strchr(word, '=') != NULL)
+        result = 1;
+      command = 0;
+    }
+  }
+
+  for (int i = 0; args[i] != NULL; i++)
+    free(args[i]);
+  free(args);
+  free(copy);
+  return result;
+}
+
+static void load_tasks(FILE *stream) {
+  int cap = 0;
+  int last_barrier = -1;
+  char *pending_name = NULL;
+  char **pending_after = NULL;
+  int npending_after = 0;
+
+  char *line = NULL;
+  size_t bufsize = 0;
+  int lineno = 0;
+
+  while (getline(&line, &bufsize, stream) != -1) {
+    lineno++;
+    char *text = trim(line);
+
+    if (strncmp(text, "#@task", 6) == 0) {
+      // #@task NAME [after DEP...]
+      char *word = strtok(text + 6, " \t");
+      free(pending_name);
+      pending_name = word ? strdup(word) : NULL;
+      int after = 0;
+      while ((word = strtok(NULL, " \t")) != NULL) {
+        if (!after && strcmp(word, "after") == 0) {
+          after = 1;
+          continue;
+        }
+        pending_after =
+            realloc(pending_after, (npending_after + 1) * sizeof(char *));
+        pending_after[npending_after++] = strdup(word);
+      }
+      continue;
+    }
+
+    if (text[0] == '\0' || text[0] == '#')
+      continue;
+
+    if (ntasks >= cap) {
+      cap = cap ? cap * 2 : 64;
+      tasks = realloc(tasks, cap * sizeof(*tasks));
+      if (!tasks) {
+        fprintf(stderr, "arsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    struct task *t = &tasks[ntasks];
+    memset(t, 0, sizeof(*t));
+    t->line = strdup(text);
+    t->lineno = lineno;
+    t->fd = -1;
+    t->name = pending_name;
+    pending_name = NULL;
+
+    t->barrier = strcmp(text, "wait") == 0 || changes_shell_state(text);
+    t->in_shell = t->barrier;
+
+    if (t->barrier) {
+      // everything since the previous barrier
+      for (int i = last_barrier < 0 ? 0 : last_barrier; i < ntasks; i++)
+        add_dep(t, i);
+    } else if (last_barrier >= 0) {
+      add_dep(t, last_barrier);
+    }
+
+    for (int i = 0; i < npending_after; i++) {
+      int dep = find_task(pending_after[i]);
+      if (dep < 0)
+        fprintf(stderr, "arsh: line %d: unknown task \"%s\"\n", lineno,
+                pending_after[i]);
+      else
+        add_dep(t, dep);
+      free(pending_after[i]);
+    }
+    npending_after = 0;
+
+    if (t->barrier)
+      last_barrier = ntasks;
+    ntasks++;
+  }
+
+  free(line);
+  free(pending_name);
+  free(pending_after);
+}
+
+static int deps_done(struct task *t) {
+  for (int i = 0; i < t->ndeps; i++) {
+    if (tasks[t->deps[i]].state != TASK_DONE)
+      return 0;
+  }
+  return 1;
+}
+
+static int start_task(struct task *t) {
+  int pipefd[2];
+  if (pipe(pipefd) < 0) {
+    perror("arsh: pipe");
+    return -1;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("arsh: fork");
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return -1;
+  }
+
+  if (pid == 0) {
+    close(pipefd[0]);
+    int devnull = open("/dev/null", O_RDONLY);
+    if (devnull != -1) {
+      dup2(devnull, STDIN_FILENO);
+      close(devnull);
+    }
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    close(pipefd[1]);
+
+    // the other tasks' pipes belong to the scheduler
+    for (int i = 0; i < ntasks; i++) {
+      if (tasks[i].fd != -1)
+        close(tasks[i].fd);
+    }
+
+    arsh_audit_init();
+    arsh_execute_line(t->line);
+    arsh_audit_flush();
+    fflush(stdout);
+    fflush(stderr);
+    _exit(last_exit_status);
+  }
+
+  close(pipefd[1]);
+  arsh_stats_track(pid, t->line);
+  t->pid = pid;
+  t->fd = pipefd[0];
+  t->state = TASK_RUNNING;
+  return 0;
+}
+
+static void buffer_output(struct task *t) {
+  if (t->out_len + 4096 > t->out_cap) {
+    t->out_cap = t->out_cap ? t->out_cap * 2 : 8192;
+    t->out = realloc(t->out, t->out_cap);
+    if (!t->out) {
+      fprintf(stderr, "arsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  ssize_t n = read(t->fd, t->out + t->out_len, t->out_cap - t->out_len);
+  if (n < 0 && errno == EINTR)
+    return;
+  if (n > 0) {
+    t->out_len += n;
+    return;
+  }
+
+  // EOF: the task is finished once its process is reaped
+  close(t->fd);
+  t->fd = -1;
+  int status;
+  if (arsh_stats_wait(t->pid, &status, 0, NULL) == -1)
+    t->status = 1;
+  else if (WIFEXITED(status))
+    t->status = WEXITSTATUS(status);
+  else
+    t->status = 128 + WTERMSIG(status);
+  t->state = TASK_DONE;
+}
+
+int arsh_run_parallel(FILE *stream, int jobs) {
+  load_tasks(stream);
+
+  struct pollfd *pfds = malloc((jobs + 1) * sizeof(struct pollfd));
+  int *polled = malloc((jobs + 1) * sizeof(int));
+  if (!pfds || !polled) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int running = 0;
+  int flushed = 0;
+  int failed = 0;
+  int stop = 0;
+
+  while (flushed < ntasks) {
+    // hand ready tasks to free slots, in script order
+    for (int i = flushed; i < ntasks && !stop; i++) {
+      struct task *t = &tasks[i];
+      if (t->state != TASK_PENDING || !deps_done(t))
+        continue;
+
+      if (t->in_shell) {
+        // barriers run here, after the output before them is flushed
+        if (i != flushed)
+          break;
+        if (strcmp(t->line, "wait") != 0 && !arsh_execute_line(t->line))
+          stop = 1;
+        t->status = last_exit_status;
+        t->state = TASK_DONE;
+        continue;
+      }
+
+      if (running >= jobs)
+        continue;
+      if (start_task(t) == 0) {
+        running++;
+      } else {
+        t->status = 1;
+        t->state = TASK_DONE;
+      }
+    }
+
+    // flush finished tasks in script order
+    while (flushed < ntasks && tasks[flushed].state == TASK_DONE) {
+      struct task *t = &tasks[flushed];
+      if (t->out_len > 0)
+        fwrite(t->out, 1, t->out_len, stdout);
+      fflush(stdout);
+      if (t->status != 0) {
+        fprintf(stderr, "arsh: line %d: \"%s\" exited with %d\n", t->lineno,
+                t->line, t->status);
+        failed = t->status;
+      }
+      free(t->out);
+      t->out = NULL;
+      flushed++;
+    }
+
+    if (stop) {
+      // exit: drain what is running, skip the rest
+      if (running == 0)
+        break;
+    }
+
+    if (running == 0)
+      continue;
+
+    int npfds = 0;
+    for (int i = flushed; i < ntasks; i++) {
+      if (tasks[i].state == TASK_RUNNING) {
+        pfds[npfds].fd = tasks[i].fd;
+        pfds[npfds].events = POLLIN;
+        polled[npfds++] = i;
+      }
+    }
+
+    if (poll(pfds, npfds, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("arsh: poll");
+      break;
+    }
+
+    for (int k = 0; k < npfds; k++) {
+      if (pfds[k].revents == 0)
+        continue;
+      struct task *t = &tasks[polled[k]];
+      buffer_output(t);
+      if (t->state == TASK_DONE)
+        running--;
+    }
+  }
+
+  for (int i = 0; i < ntasks; i++) {
+    free(tasks[i].line);
+    free(tasks[i].name);
+    free(tasks[i].deps);
+    free(tasks[i].out);
+  }
+  free(tasks);
+  tasks = NULL;
+  ntasks = 0;
+  free(pfds);
+  free(polled);
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -4,6 +4,21 @@
 #define arsh_TOK_BUFSIZE 64
 #define arsh_TOK_DELIM " \t\r\n\a"
 
+static char **add_token(char **tokens, int *position, int *bufsize,
+                        const char *token) {
+  tokens[(*position)++] = strdup(token);
+
+  if (*position >= *bufsize) {
+    *bufsize += arsh_TOK_BUFSIZE;
+    tokens = realloc(tokens, *bufsize * sizeof(char *));
+    if (!tokens) {
+      fprintf(stderr, "arsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return tokens;
+}
+
 char **arsh_split_line(char *line) {
   int bufsize = arsh_TOK_BUFSIZE, position = 0;
   char **tokens = malloc(bufsize * sizeof(char *));
@@ -15,7 +30,10 @@ char **arsh_split_line(char *line) {
   }
 
   token = malloc(strlen(line) + 1);
-  if (!token) {
+  // open parentheses: 'g' for a ( ) group, 'w' for one inside a word such
+  // as <(cmd) or $((expr)) whose ')' stays part of the word
+  char *parens = malloc(strlen(line) + 1);
+  if (!token || !parens) {
     fprintf(stderr, "arsh: allocation error\n");
     exit(EXIT_FAILURE);
   }
@@ -23,6 +41,7 @@ char **arsh_split_line(char *line) {
   int i = 0;        // index for input 'line'
   int j = 0;        // index for corrent 'token' buffer
   int in_quote = 0; // falg for quotes
+  int depth = 0;    // index into 'parens'
 
   while (line[i] != '\0') {
     char c = line[i];
@@ -32,19 +51,29 @@ char **arsh_split_line(char *line) {
       // found a delimiter and we are not in quotes
       if (j > 0) {
         token[j] = '\0';
-        tokens[position++] = strdup(token);
+        tokens = add_token(tokens, &position, &bufsize, token);
+        j = 0;
+      }
+    } else if (!in_quote && (c == ';' || (c == '(' && j == 0) ||
+                             (c == ')' && depth > 0 &&
+                              parens[depth - 1] == 'g'))) {
+      // ';' and group parentheses are tokens of their own
+      if (j > 0) {
+        token[j] = '\0';
+        tokens = add_token(tokens, &position, &bufsize, token);
         j = 0;
-
-        if (position >= bufsize) {
-          bufsize += arsh_TOK_BUFSIZE;
-          tokens = realloc(tokens, bufsize * sizeof(char *));
-          if (!tokens) {
-            fprintf(stderr, "arsh: allocation error\n");
-            exit(EXIT_FAILURE);
-          }
-        }
       }
+      if (c == '(')
+        parens[depth++] = 'g';
+      else if (c == ')')
+        depth--;
+      char op[2] = {c, '\0'};
+      tokens = add_token(tokens, &position, &bufsize, op);
     } else {
+      if (!in_quote && c == '(')
+        parens[depth++] = 'w';
+      else if (!in_quote && c == ')' && depth > 0)
+        depth--;
       token[j] = c;
       j++;
     }
@@ -56,6 +85,7 @@ char **arsh_split_line(char *line) {
     tokens[position++] = strdup(token);
   }
 
+  free(parens);
   free(token);
   tokens[position] = NULL;
 
@@ -80,13 +110,18 @@ char **arsh_expand_wildcards(char **args) {
           glob(args[i], GLOB_NOCHECK | GLOB_TILDE, NULL, &glob_result);
 
       if (return_value == 0) {
+        // reserve room for the whole match list at once; doubling keeps
+        // huge expansions from degenerating into repeated reallocs
+        while (position + glob_result.gl_pathc + 1 >= (size_t)bufsize)
+          bufsize *= 2;
+        tokens = realloc(tokens, bufsize * sizeof(char *));
+        if (!tokens) {
+          fprintf(stderr, "arsh: allocation error\n");
+          exit(EXIT_FAILURE);
+        }
+
         for (size_t j = 0; j < glob_result.gl_pathc; j++) {
           tokens[position++] = strdup(glob_result.gl_pathv[j]);
-
-          if (position >= bufsize) {
-            bufsize += 64;
-            tokens = realloc(tokens, bufsize * sizeof(char *));
-          }
         }
       } else {
         tokens[position++] = strdup(args[i]);
@@ -94,10 +129,14 @@ char **arsh_expand_wildcards(char **args) {
       globfree(&glob_result);
     } else {
       tokens[position++] = strdup(args[i]);
+    }
 
-      if (position >= bufsize) {
-        bufsize += 64;
-        tokens = realloc(tokens, bufsize * sizeof(char *));
+    if (position >= bufsize) {
+      bufsize *= 2;
+      tokens = realloc(tokens, bufsize * sizeof(char *));
+      if (!tokens) {
+        fprintf(stderr, "arsh: allocation error\n");
+        exit(EXIT_FAILURE);
       }
     }
   }
@@ -138,11 +177,28 @@ char **arsh_expand_env_vars(char **args) {
     }
 
     if (position >= bufsize) {
-      bufsize += 64;
+      bufsize *= 2;
       tokens = realloc(tokens, bufsize * sizeof(char *));
+      if (!tokens) {
+        fprintf(stderr, "arsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
     }
   }
 
   tokens[position] = NULL;
   return tokens;
 }
+
+// '(' minus ')' in word; a word that opens $((, <( or a group spans the
+// following words until this adds up to zero again
+int arsh_paren_balance(const char *word) {
+  int depth = 0;
+  for (; *word; word++) {
+    if (*word == '(')
+      depth++;
+    else if (*word == ')')
+      depth--;
+  }
+  return depth;
+}
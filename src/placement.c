@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+
+#include "../include/placement.h"
+#include "../include/shell.h"
+#include <errno.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// linux/ioprio.h is not always installed, so spell out what we use
+#define ARSH_IOPRIO_WHO_PROCESS 1
+#define ARSH_IOPRIO_CLASS_SHIFT 13
+#define ARSH_IOPRIO_CLASS_RT 1
+#define ARSH_IOPRIO_CLASS_BE 2
+#define ARSH_IOPRIO_CLASS_IDLE 3
+
+// Placement prefixes are applied by the forked child to itself right
+// before exec, so they cost a few syscalls instead of a taskset, nice or
+// ionice process. Errors are reported and the child exits without running
+// the command.
+
+int arsh_is_placement(const char *word) {
+  return strncmp(word, "@cpus=", 6) == 0 || strncmp(word, "@nice=", 6) == 0 ||
+         strncmp(word, "@io=", 4) == 0 || strncmp(word, "@sched=", 7) == 0 ||
+         strncmp(word, "@pin=", 5) == 0 || strcmp(word, "@pin") == 0;
+}
+
+// the command word behind any placement prefixes
+char *arsh_placement_command(char **args) {
+  int i = 0;
+  while (args[i] != NULL && arsh_is_placement(args[i]))
+    i++;
+  return args[i] != NULL ? args[i] : args[0];
+}
+
+static void fail(const char *word, const char *why) {
+  fprintf(stderr, "arsh: %s: %s\n", word, why);
+  _exit(EXIT_FAILURE);
+}
+
+// parse a strict decimal integer, rejecting trailing junk
+static int parse_int(const char *s, long *out) {
+  char *end;
+  errno = 0;
+  *out = strtol(s, &end, 10);
+  return errno == 0 && end != s && *end == '\0' ? 0 : -1;
+}
+
+// parse a cpu list like "0-3,8,10-11" into cpus[], in the order given.
+// Returns the number of cpus, or -1 if the list is malformed.
+static int parse_cpus(const char *list, int *cpus, int max) {
+  int count = 0;
+  const char *p = list;
+
+  while (*p) {
+    char *end;
+    long first = strtol(p, &end, 10);
+    if (end == p || first < 0 || first >= CPU_SETSIZE)
+      return -1;
+    long last = first;
+    p = end;
+
+    if (*p == '-') {
+      last = strtol(p + 1, &end, 10);
+      if (end == p + 1 || last < first || last >= CPU_SETSIZE)
+        return -1;
+      p = end;
+    }
+
+    for (long cpu = first; cpu <= last && count < max; cpu++)
+      cpus[count++] = cpu;
+
+    if (*p == ',')
+      p++;
+    else if (*p != '\0')
+      return -1;
+  }
+  return count > 0 ? count : -1;
+}
+
+static void set_affinity(const char *word, const int *cpus, int count) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int i = 0; i < count; i++)
+    CPU_SET(cpus[i], &set);
+  if (sched_setaffinity(0, sizeof(set), &set) == -1)
+    fail(word, strerror(errno));
+}
+
+// pin to the stage-th cpu of a @pin=LIST, or of the cpus we may already
+// run on for a bare @pin, so consecutive stages land on neighbouring cores
+void arsh_placement_pin(const char *word, int stage) {
+  int cpus[CPU_SETSIZE];
+  int count = 0;
+
+  if (word[4] == '=') {
+    count = parse_cpus(word + 5, cpus, CPU_SETSIZE);
+    if (count == -1)
+      fail(word, "expected a cpu list like 0-3,8");
+  } else {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == -1)
+      fail(word, strerror(errno));
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set))
+        cpus[count++] = cpu;
+    }
+  }
+
+  set_affinity(word, &cpus[stage % count], 1);
+}
+
+static void apply_io(const char *word, const char *value) {
+  int class, level = 4;
+  size_t len = strcspn(value, ":");
+
+  if (strncmp(value, "idle", len) == 0 && len == 4) {
+    class = ARSH_IOPRIO_CLASS_IDLE;
+    level = 0;
+  } else if (strncmp(value, "be", len) == 0 && len == 2) {
+    class = ARSH_IOPRIO_CLASS_BE;
+  } else if (strncmp(value, "rt", len) == 0 && len == 2) {
+    class = ARSH_IOPRIO_CLASS_RT;
+  } else {
+    fail(word, "expected idle, be[:0-7] or rt[:0-7]");
+    return;
+  }
+
+  if (value[len] == ':') {
+    long n;
+    if (class == ARSH_IOPRIO_CLASS_IDLE || parse_int(value + len + 1, &n) ||
+        n < 0 || n > 7)
+      fail(word, "expected idle, be[:0-7] or rt[:0-7]");
+    level = n;
+  }
+
+  if (syscall(SYS_ioprio_set, ARSH_IOPRIO_WHO_PROCESS, 0,
+              (class << ARSH_IOPRIO_CLASS_SHIFT) | level) == -1)
+    fail(word, strerror(errno));
+}
+
+static void apply_sched(const char *word, const char *value) {
+  static const struct {
+    const char *name;
+    int policy;
+  } policies[] = {{"other", SCHED_OTHER}, {"batch", SCHED_BATCH},
+                  {"idle", SCHED_IDLE},   {"fifo", SCHED_FIFO},
+                  {"rr", SCHED_RR}};
+
+  size_t len = strcspn(value, ":");
+  int policy = -1;
+  for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+    if (strlen(policies[i].name) == len &&
+        strncmp(policies[i].name, value, len) == 0)
+      policy = policies[i].policy;
+  }
+  if (policy == -1)
+    fail(word, "expected other, batch, idle, fifo[:prio] or rr[:prio]");
+
+  struct sched_param param = {.sched_priority = 0};
+  int realtime = policy == SCHED_FIFO || policy == SCHED_RR;
+  if (realtime)
+    param.sched_priority = 1;
+  if (value[len] == ':') {
+    long prio;
+    if (!realtime || parse_int(value + len + 1, &prio) ||
+        prio < sched_get_priority_min(policy) ||
+        prio > sched_get_priority_max(policy))
+      fail(word, "priority only applies to fifo and rr (1-99)");
+    param.sched_priority = prio;
+  }
+
+  if (sched_setscheduler(0, policy, &param) == -1)
+    fail(word, strerror(errno));
+}
+
+static void apply_word(const char *word) {
+  if (strncmp(word, "@cpus=", 6) == 0) {
+    int cpus[CPU_SETSIZE];
+    int count = parse_cpus(word + 6, cpus, CPU_SETSIZE);
+    if (count == -1)
+      fail(word, "expected a cpu list like 0-3,8");
+    set_affinity(word, cpus, count);
+  } else if (strncmp(word, "@nice=", 6) == 0) {
+    long n;
+    if (parse_int(word + 6, &n) || n < -20 || n > 19)
+      fail(word, "expected a niceness from -20 to 19");
+    if (setpriority(PRIO_PROCESS, 0, n) == -1)
+      fail(word, strerror(errno));
+  } else if (strncmp(word, "@io=", 4) == 0) {
+    apply_io(word, word + 4);
+  } else if (strncmp(word, "@sched=", 7) == 0) {
+    apply_sched(word, word + 7);
+  } else {
+    arsh_placement_pin(word, 0);
+  }
+}
+
+// apply and strip the leading placement prefixes of args
+void arsh_placement_apply(char **args) {
+  int k = 0;
+  while (args[k] != NULL && arsh_is_placement(args[k]))
+    apply_word(args[k++]);
+  if (k == 0)
+    return;
+
+  if (args[k] == NULL)
+    fail(args[k - 1], "expected a command after placement prefixes");
+
+  int i = 0;
+  do {
+    args[i] = args[i + k];
+  } while (args[i++] != NULL);
+}
+
+// default placement for background jobs, from $ARSH_BG_PLACEMENT
+// (e.g. "@nice=10 @io=idle"); the command's own prefixes still win
+void arsh_placement_background() {
+  char *env = getenv("ARSH_BG_PLACEMENT");
+  if (env == NULL)
+    return;
+
+  char *words = strdup(env);
+  if (!words) {
+    fprintf(stderr, "arsh: allocation error\n");
+    _exit(EXIT_FAILURE);
+  }
+
+  for (char *word = strtok(words, " \t"); word != NULL;
+       word = strtok(NULL, " \t")) {
+    if (!arsh_is_placement(word))
+      fail(word, "not a placement prefix in ARSH_BG_PLACEMENT");
+    apply_word(word);
+  }
+  free(words);
+}
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+
+#include "../include/procsub.h"
+#include "../include/audit.h"
+#include "../include/executor.h"
+#include "../include/parser.h"
+#include "../include/shell.h"
+#include "../include/stats.h"
+
+// one running <(cmd) or >(cmd): the shell keeps its end of the pipe open
+// (close-on-exec) until the command that uses /dev/fd/N has finished
+struct procsub {
+  int fd;
+  pid_t pid;
+};
+
+static struct procsub *subs = NULL;
+static int subs_count = 0;
+static int subs_cap = 0;
+
+int arsh_procsub_mark() { return subs_count; }
+
+static int is_procsub(const char *arg) {
+  return (arg[0] == '<' || arg[0] == '>') && arg[1] == '(';
+}
+
+// fork cmd with its stdout (for <) or stdin (for >) connected to a pipe and
+// return the shell's end of that pipe, or -1
+static int start_procsub(char **cmd, int output) {
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) < 0) {
+    perror("arsh: pipe");
+    return -1;
+  }
+
+  int child_end = output ? pipefd[1] : pipefd[0];
+  int shell_end = output ? pipefd[0] : pipefd[1];
+  int target = output ? STDOUT_FILENO : STDIN_FILENO;
+
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("arsh: fork");
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return -1;
+  }
+
+  if (pid == 0) {
+    // the other substitutions belong to the parent's command
+    for (int i = 0; i < subs_count; i++)
+      close(subs[i].fd);
+    subs_count = 0;
+    close(shell_end);
+
+    dup2(child_end, target);
+    close(child_end);
+
+    // the writer thread stayed behind in the shell: start one here
+    arsh_audit_init();
+    arsh_execute(cmd);
+    arsh_audit_flush();
+    fflush(stdout);
+    fflush(stderr);
+    // _exit: exit() would rewind the script stream we share with the shell
+    _exit(last_exit_status);
+  }
+
+  close(child_end);
+  arsh_stats_track(pid, cmd[0]);
+
+  if (subs_count >= subs_cap) {
+    subs_cap = subs_cap ? subs_cap * 2 : 8;
+    subs = realloc(subs, subs_cap * sizeof(*subs));
+    if (!subs) {
+      fprintf(stderr, "arsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  subs[subs_count].fd = shell_end;
+  subs[subs_count].pid = pid;
+  subs_count++;
+
+  return shell_end;
+}
+
+// replace every <(...) and >(...) with /dev/fd/N, starting the substituted
+// commands so they run concurrently with the main command
+char **arsh_expand_procsubs(char **args) {
+  int bufsize = 64;
+  int position = 0;
+  char **tokens = malloc(bufsize * sizeof(char *));
+
+  if (!tokens) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; args[i] != NULL; i++) {
+    if (is_procsub(args[i])) {
+      int output = args[i][0] == '<';
+
+      // the substitution may span several tokens: collect up to the
+      // matching ')' and strip the "<(" / ")" wrapper
+      int start = i;
+      int depth = arsh_paren_balance(args[i]);
+      while (depth > 0 && args[i + 1] != NULL) {
+        i++;
+        depth += arsh_paren_balance(args[i]);
+      }
+
+      if (depth != 0) {
+        fprintf(stderr, "arsh: unterminated process substitution\n");
+        tokens[position++] = strdup(args[start]);
+      } else {
+        int n = i - start + 1;
+        char **cmd = malloc((n + 1) * sizeof(char *));
+        int len = 0;
+        for (int k = start; k <= i; k++) {
+          char *word = strdup(k == start ? args[k] + 2 : args[k]);
+          if (k == i)
+            word[strlen(word) - 1] = '\0';
+          if (word[0] == '\0')
+            free(word);
+          else
+            cmd[len++] = word;
+        }
+        cmd[len] = NULL;
+
+        int fd = len > 0 ? start_procsub(cmd, output) : -1;
+        if (fd >= 0) {
+          char path[32];
+          snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+          tokens[position++] = strdup(path);
+        } else {
+          tokens[position++] = strdup("/dev/null");
+        }
+
+        for (int k = 0; k < len; k++)
+          free(cmd[k]);
+        free(cmd);
+      }
+    } else {
+      tokens[position++] = strdup(args[i]);
+    }
+
+    if (position >= bufsize) {
+      bufsize *= 2;
+      tokens = realloc(tokens, bufsize * sizeof(char *));
+      if (!tokens) {
+        fprintf(stderr, "arsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  tokens[position] = NULL;
+  return tokens;
+}
+
+// called in a forked child before exec: keep open only the substitution
+// fds that this command actually names, the rest close on exec
+void arsh_procsub_prepare_child(char **args) {
+  for (int i = 0; args[i] != NULL; i++) {
+    int fd;
+    char trailing;
+    if (sscanf(args[i], "/dev/fd/%d%c", &fd, &trailing) != 1)
+      continue;
+
+    for (int k = 0; k < subs_count; k++) {
+      if (subs[k].fd == fd) {
+        int flags = fcntl(fd, F_GETFD);
+        if (flags != -1)
+          fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC);
+        break;
+      }
+    }
+  }
+}
+
+// close the shell's pipe ends opened since mark and reap the substituted
+// commands; background commands leave the reaping to the main loop
+void arsh_procsub_finish(int mark, int background) {
+  for (int i = mark; i < subs_count; i++)
+    close(subs[i].fd);
+
+  if (!background) {
+    for (int i = mark; i < subs_count; i++)
+      arsh_stats_wait(subs[i].pid, NULL, 0, NULL);
+  }
+
+  subs_count = mark;
+}
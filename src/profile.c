@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+
+#include "../include/profile.h"
+#include "../include/shell.h"
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#define ARSH_RELAY_CHUNK (1 << 16)
+
+static double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// block until fd is ready for events, charging the wait to *wait_ms
+static void timed_poll(int fd, short events, double *wait_ms) {
+  struct pollfd pfd = {.fd = fd, .events = events};
+  double start = now_ms();
+  while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+    ;
+  *wait_ms += now_ms() - start;
+}
+
+// portable fallback: plain read/write through a user-space buffer
+static void relay_copy(struct arsh_relay *r) {
+  char buf[ARSH_RELAY_CHUNK];
+
+  fcntl(r->in_fd, F_SETFL, fcntl(r->in_fd, F_GETFL) & ~O_NONBLOCK);
+  fcntl(r->out_fd, F_SETFL, fcntl(r->out_fd, F_GETFL) & ~O_NONBLOCK);
+
+  while (1) {
+    double start = now_ms();
+    ssize_t n = read(r->in_fd, buf, sizeof(buf));
+    r->read_wait_ms += now_ms() - start;
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+
+    for (ssize_t off = 0; off < n;) {
+      start = now_ms();
+      ssize_t w = write(r->out_fd, buf + off, n - off);
+      r->write_wait_ms += now_ms() - start;
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0)
+        return;
+      off += w;
+      r->bytes += w;
+    }
+  }
+}
+
+static void *relay_main(void *arg) {
+  struct arsh_relay *r = arg;
+  double start = now_ms();
+
+  // a consumer that exits early must not take the whole shell down
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+#ifdef __linux__
+  fcntl(r->in_fd, F_SETFL, fcntl(r->in_fd, F_GETFL) | O_NONBLOCK);
+  fcntl(r->out_fd, F_SETFL, fcntl(r->out_fd, F_GETFL) | O_NONBLOCK);
+
+  while (1) {
+    // pipe-to-pipe splice moves page references, never the bytes
+    ssize_t n = splice(r->in_fd, NULL, r->out_fd, NULL, ARSH_RELAY_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      r->bytes += n;
+      continue;
+    }
+    if (n == 0)
+      break;
+    if (errno == EINTR)
+      continue;
+    if (errno == EINVAL) {
+      relay_copy(r);
+      break;
+    }
+    if (errno != EAGAIN)
+      break;
+
+    // EAGAIN: either nothing to read or no room to write; find out which
+    struct pollfd in = {.fd = r->in_fd, .events = POLLIN};
+    if (poll(&in, 1, 0) > 0)
+      timed_poll(r->out_fd, POLLOUT, &r->write_wait_ms);
+    else
+      timed_poll(r->in_fd, POLLIN, &r->read_wait_ms);
+  }
+#else
+  relay_copy(r);
+#endif
+
+  close(r->in_fd);
+  close(r->out_fd);
+  r->life_ms = now_ms() - start;
+  return NULL;
+}
+
+int arsh_relay_start(struct arsh_relay *relay) {
+  relay->bytes = 0;
+  relay->read_wait_ms = 0;
+  relay->write_wait_ms = 0;
+  relay->life_ms = 0;
+
+  int err = pthread_create(&relay->thread, NULL, relay_main, relay);
+  if (err != 0) {
+    fprintf(stderr, "arsh: relay thread: %s\n", strerror(err));
+    return -1;
+  }
+  return 0;
+}
+
+void arsh_relay_join(struct arsh_relay *relay) {
+  pthread_join(relay->thread, NULL);
+}
+
+static double fraction(double part, double whole) {
+  return whole > 0 ? part / whole : 0;
+}
+
+void arsh_profile_report(char ***stages, struct arsh_proc_stats *stats,
+                         struct arsh_relay *relays, int n) {
+  fprintf(stderr, "\n%-5s %-16s %10s %10s %10s %6s\n", "stage", "command",
+          "wall(ms)", "user(ms)", "sys(ms)", "status");
+  for (int i = 0; i < n; i++) {
+    int status = WIFEXITED(stats[i].status)
+                     ? WEXITSTATUS(stats[i].status)
+                     : 128 + WTERMSIG(stats[i].status);
+    fprintf(stderr, "%-5d %-16s %10.3f %10.3f %10.3f %6d\n", i, stages[i][0],
+            stats[i].wall_ms, stats[i].user_ms, stats[i].sys_ms, status);
+  }
+
+  if (n < 2)
+    return;
+
+  fprintf(stderr, "\n%-8s %14s %10s %14s %15s\n", "edge", "bytes", "MB/s",
+          "read-wait(ms)", "write-wait(ms)");
+  for (int i = 0; i < n - 1; i++) {
+    struct arsh_relay *r = &relays[i];
+    double mbps = r->life_ms > 0 ? r->bytes / 1e6 / (r->life_ms / 1000) : 0;
+    fprintf(stderr, "%2d -> %-2d %14llu %10.2f %14.3f %15.3f\n", i, i + 1,
+            r->bytes, mbps, r->read_wait_ms, r->write_wait_ms);
+  }
+
+  // A relay waiting to read means its producer is slow; waiting to write
+  // means its consumer is slow. The bottleneck is the stage that keeps its
+  // input edge waiting to write and its output edge waiting to read.
+  fprintf(stderr, "\n");
+  int bottleneck = 0;
+  double best = -1;
+  for (int i = 0; i < n; i++) {
+    double stalls = 0, slow = 0;
+    int edges = 0;
+
+    if (i > 0) {
+      struct arsh_relay *in = &relays[i - 1];
+      double starving = fraction(in->read_wait_ms, in->life_ms);
+      stalls = fraction(in->write_wait_ms, in->life_ms);
+      slow += stalls;
+      edges++;
+      if (starving > 0.5)
+        fprintf(stderr, "stage %d (%s) is starving: %.0f%% of its input edge "
+                        "waited on stage %d\n",
+                i, stages[i][0], starving * 100, i - 1);
+      if (stalls > 0.5)
+        fprintf(stderr, "stage %d (%s) is stalling its producer: %.0f%% of "
+                        "its input edge waited on it\n",
+                i, stages[i][0], stalls * 100);
+    }
+    if (i < n - 1) {
+      struct arsh_relay *out = &relays[i];
+      slow += fraction(out->read_wait_ms, out->life_ms);
+      edges++;
+    }
+
+    double score = edges > 0 ? slow / edges : 0;
+    if (score > best) {
+      best = score;
+      bottleneck = i;
+    }
+  }
+  fprintf(stderr, "bottleneck: stage %d (%s)\n", bottleneck,
+          stages[bottleneck][0]);
+}
@@ -0,0 +1,174 @@
+#include "../include/scope.h"
+#include "../include/audit.h"
+#include "../include/shell.h"
+
+extern char **environ;
+
+// One level of in-process grouping. Subshells (isolate) snapshot the
+// environment and cwd lazily, on the first builtin that changes them, so a
+// subshell that only reads state costs nothing. Redirected stdio is saved
+// for every group and restored when it ends.
+struct scope {
+  int isolate;
+  char **env;       // copy of environ, NULL until first change
+  int cwd_fd;       // fd of the old cwd, -1 until first chdir
+  int saved_fds[3]; // original stdin/stdout/stderr, -1 if not redirected
+};
+
+static struct scope *scopes = NULL;
+static int scopes_count = 0;
+static int scopes_cap = 0;
+
+void arsh_scope_push(int isolate) {
+  if (scopes_count >= scopes_cap) {
+    scopes_cap = scopes_cap ? scopes_cap * 2 : 8;
+    scopes = realloc(scopes, scopes_cap * sizeof(*scopes));
+    if (!scopes) {
+      fprintf(stderr, "arsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  struct scope *sc = &scopes[scopes_count++];
+  sc->isolate = isolate;
+  sc->env = NULL;
+  sc->cwd_fd = -1;
+  for (int i = 0; i < 3; i++)
+    sc->saved_fds[i] = -1;
+}
+
+// innermost scope that discards changes, or NULL at top level
+static struct scope *isolating_scope() {
+  for (int i = scopes_count - 1; i >= 0; i--) {
+    if (scopes[i].isolate)
+      return &scopes[i];
+  }
+  return NULL;
+}
+
+void arsh_scope_touch_env() {
+  struct scope *sc = isolating_scope();
+  if (sc == NULL || sc->env != NULL)
+    return;
+
+  int n = 0;
+  while (environ[n] != NULL)
+    n++;
+
+  sc->env = malloc((n + 1) * sizeof(char *));
+  if (!sc->env) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < n; i++)
+    sc->env[i] = strdup(environ[i]);
+  sc->env[n] = NULL;
+}
+
+void arsh_scope_touch_cwd() {
+  struct scope *sc = isolating_scope();
+  if (sc == NULL || sc->cwd_fd != -1)
+    return;
+
+  sc->cwd_fd = open(".", O_RDONLY | O_CLOEXEC);
+  if (sc->cwd_fd == -1)
+    perror("arsh: save cwd");
+}
+
+static void restore_env(char **snapshot) {
+  int n = 0;
+  while (environ[n] != NULL)
+    n++;
+
+  // unsetenv() edits environ, so collect the names first
+  char **names = malloc((n + 1) * sizeof(char *));
+  if (!names) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < n; i++)
+    names[i] = strndup(environ[i], strcspn(environ[i], "="));
+  for (int i = 0; i < n; i++) {
+    unsetenv(names[i]);
+    free(names[i]);
+  }
+  free(names);
+
+  for (int i = 0; snapshot[i] != NULL; i++) {
+    char *equal_sign = strchr(snapshot[i], '=');
+    if (equal_sign != NULL) {
+      *equal_sign = '\0';
+      setenv(snapshot[i], equal_sign + 1, 1);
+    }
+    free(snapshot[i]);
+  }
+  free(snapshot);
+}
+
+void arsh_scope_pop() {
+  if (scopes_count == 0)
+    return;
+  struct scope *sc = &scopes[--scopes_count];
+
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < 3; i++) {
+    if (sc->saved_fds[i] != -1) {
+      dup2(sc->saved_fds[i], i);
+      close(sc->saved_fds[i]);
+    }
+  }
+
+  if (sc->cwd_fd != -1) {
+    if (fchdir(sc->cwd_fd) != 0)
+      perror("arsh: restore cwd");
+    close(sc->cwd_fd);
+    arsh_audit_set_cwd(NULL);
+  }
+
+  if (sc->env != NULL)
+    restore_env(sc->env);
+}
+
+// apply the >, >> and < pairs in args to the shell itself, remembering the
+// original fds in the current scope. Returns -1 on error.
+int arsh_scope_redirect(char **args) {
+  struct scope *sc = scopes_count > 0 ? &scopes[scopes_count - 1] : NULL;
+
+  for (int i = 0; args[i] != NULL; i++) {
+    int flags, target;
+    if (strcmp(args[i], ">>") == 0) {
+      flags = O_WRONLY | O_CREAT | O_APPEND;
+      target = STDOUT_FILENO;
+    } else if (strcmp(args[i], ">") == 0) {
+      flags = O_WRONLY | O_CREAT | O_TRUNC;
+      target = STDOUT_FILENO;
+    } else if (strcmp(args[i], "<") == 0) {
+      flags = O_RDONLY;
+      target = STDIN_FILENO;
+    } else {
+      fprintf(stderr, "arsh: unexpected \"%s\" after group\n", args[i]);
+      return -1;
+    }
+
+    if (args[i + 1] == NULL) {
+      fprintf(stderr, "arsh: expected argument to \"%s\"\n", args[i]);
+      return -1;
+    }
+
+    int fd = open(args[++i], flags, 0644);
+    if (fd == -1) {
+      perror("arsh: open");
+      return -1;
+    }
+
+    if (sc != NULL && sc->saved_fds[target] == -1)
+      sc->saved_fds[target] = fcntl(target, F_DUPFD_CLOEXEC, 10);
+
+    fflush(stdout);
+    if (dup2(fd, target) == -1)
+      perror("arsh: dup2");
+    close(fd);
+  }
+  return 0;
+}
@@ -0,0 +1,444 @@
+#define _GNU_SOURCE
+
+#include "../include/server.h"
+#include "../include/audit.h"
+#include "../include/executor.h"
+#include "../include/parser.h"
+#include "../include/shell.h"
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define ARSH_REQ_BODY_MAX (1 << 20)
+
+// a script kept tokenized across requests, invalidated by mtime/size
+struct cached_script {
+  char *path;
+  struct timespec mtime;
+  off_t size;
+  char ***lines;
+  int count;
+};
+
+static struct cached_script *scripts = NULL;
+static int scripts_count = 0;
+
+static void free_script_lines(struct cached_script *cs) {
+  for (int i = 0; i < cs->count; i++) {
+    for (int j = 0; cs->lines[i][j] != NULL; j++)
+      free(cs->lines[i][j]);
+    free(cs->lines[i]);
+  }
+  free(cs->lines);
+  cs->lines = NULL;
+  cs->count = 0;
+}
+
+static int load_script(struct cached_script *cs, const struct stat *st) {
+  FILE *f = fopen(cs->path, "r");
+  if (!f)
+    return -1;
+
+  free_script_lines(cs);
+
+  int cap = 64;
+  cs->lines = malloc(cap * sizeof(char **));
+  if (!cs->lines) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char *line = NULL;
+  size_t bufsize = 0;
+  while (getline(&line, &bufsize, f) != -1) {
+    line[strcspn(line, "\n")] = 0;
+    if (cs->count >= cap) {
+      cap *= 2;
+      cs->lines = realloc(cs->lines, cap * sizeof(char **));
+      if (!cs->lines) {
+        fprintf(stderr, "arsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    cs->lines[cs->count++] = arsh_split_line(line);
+  }
+  free(line);
+  fclose(f);
+
+  cs->mtime = st->st_mtim;
+  cs->size = st->st_size;
+  return 0;
+}
+
+// return the parsed script for path, (re)loading it if it changed on disk
+static struct cached_script *get_script(const char *path) {
+  struct stat st;
+  if (stat(path, &st) == -1)
+    return NULL;
+
+  struct cached_script *cs = NULL;
+  for (int i = 0; i < scripts_count; i++) {
+    if (strcmp(scripts[i].path, path) == 0) {
+      cs = &scripts[i];
+      break;
+    }
+  }
+
+  if (cs != NULL && cs->size == st.st_size &&
+      cs->mtime.tv_sec == st.st_mtim.tv_sec &&
+      cs->mtime.tv_nsec == st.st_mtim.tv_nsec)
+    return cs;
+
+  if (cs == NULL) {
+    scripts = realloc(scripts, (scripts_count + 1) * sizeof(*scripts));
+    if (!scripts) {
+      fprintf(stderr, "arsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    cs = &scripts[scripts_count++];
+    memset(cs, 0, sizeof(*cs));
+    cs->path = strdup(path);
+  }
+
+  if (load_script(cs, &st) == -1)
+    return NULL;
+  return cs;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// receive header and the three stdio fds in one message
+static int recv_request(int conn, struct arsh_request_hdr *hdr, int fds[3]) {
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec iov = {.iov_base = hdr, .iov_len = sizeof(*hdr)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  if (n == 0)
+    return 1; // connected and hung up, e.g. another server probing us
+  if (n != sizeof(*hdr))
+    return -1;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+    return -1;
+
+  memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+  return 0;
+}
+
+static int peer_allowed(int conn) {
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+    return 0;
+  return cred.uid == getuid();
+#else
+  (void)conn;
+  return 1;
+#endif
+}
+
+// runs in the forked per-request child: adopt the client's stdio and cwd,
+// execute, and report the exit status back over the connection
+static void serve_request(int conn, int fds[3], const char *cwd,
+                          const struct arsh_request_hdr *hdr, char *body,
+                          struct cached_script *cs) {
+  for (int i = 0; i < 3; i++) {
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+
+  arsh_audit_init();
+  last_exit_status = 0;
+  if (chdir(cwd) != 0) {
+    perror("arsh: server chdir");
+    last_exit_status = 1;
+  } else {
+    arsh_audit_set_cwd(cwd);
+    if (hdr->kind == ARSH_REQ_COMMAND) {
+      arsh_execute_line(body);
+    } else {
+      for (int i = 0; i < cs->count; i++) {
+        if (!arsh_execute(cs->lines[i]))
+          break;
+      }
+    }
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+
+  int32_t status = last_exit_status;
+  write_full(conn, &status, sizeof(status));
+  exit(EXIT_SUCCESS);
+}
+
+static void handle_connection(int listen_fd, int conn) {
+  struct arsh_request_hdr hdr;
+  int fds[3];
+
+  if (!peer_allowed(conn)) {
+    fprintf(stderr, "arsh: server: rejected client with foreign uid\n");
+    return;
+  }
+
+  int got = recv_request(conn, &hdr, fds);
+  if (got == 1)
+    return;
+  if (got == -1) {
+    fprintf(stderr, "arsh: server: malformed request\n");
+    return;
+  }
+
+  char *cwd = NULL;
+  char *body = NULL;
+  struct cached_script *cs = NULL;
+
+  if (hdr.cwd_len == 0 || hdr.cwd_len > PATH_MAX ||
+      hdr.body_len > ARSH_REQ_BODY_MAX ||
+      (hdr.kind != ARSH_REQ_COMMAND && hdr.kind != ARSH_REQ_SCRIPT)) {
+    fprintf(stderr, "arsh: server: malformed request\n");
+    goto out;
+  }
+
+  cwd = malloc(hdr.cwd_len + 1);
+  body = malloc(hdr.body_len + 1);
+  if (!cwd || !body) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (read_full(conn, cwd, hdr.cwd_len) == -1 ||
+      read_full(conn, body, hdr.body_len) == -1) {
+    fprintf(stderr, "arsh: server: truncated request\n");
+    goto out;
+  }
+  cwd[hdr.cwd_len] = '\0';
+  body[hdr.body_len] = '\0';
+
+  // scripts are parsed in the server so the cache survives the fork
+  if (hdr.kind == ARSH_REQ_SCRIPT) {
+    cs = get_script(body);
+    if (cs == NULL) {
+      dprintf(fds[2], "arsh: %s: %s\n", body, strerror(errno));
+      int32_t status = 127;
+      write_full(conn, &status, sizeof(status));
+      goto out;
+    }
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(listen_fd);
+    serve_request(conn, fds, cwd, &hdr, body, cs);
+  } else if (pid < 0) {
+    perror("arsh: server fork");
+  }
+
+out:
+  for (int i = 0; i < 3; i++)
+    close(fds[i]);
+  free(cwd);
+  free(body);
+}
+
+int arsh_server(const char *sock_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "arsh: socket path too long\n");
+    return EXIT_FAILURE;
+  }
+  strcpy(addr.sun_path, sock_path);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1) {
+    perror("arsh: socket");
+    return EXIT_FAILURE;
+  }
+
+  // replace a stale socket left behind by a previous server, but never
+  // one that a live server still answers on
+  struct stat st;
+  if (lstat(sock_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe == -1) {
+      perror("arsh: socket");
+      close(listen_fd);
+      return EXIT_FAILURE;
+    }
+    int live = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    int stale = !live && errno == ECONNREFUSED;
+    close(probe);
+
+    if (live) {
+      fprintf(stderr, "arsh: %s: another server is already listening\n",
+              sock_path);
+      close(listen_fd);
+      return EXIT_FAILURE;
+    }
+    if (!stale) {
+      fprintf(stderr, "arsh: %s: cannot check existing socket: %s\n",
+              sock_path, strerror(errno));
+      close(listen_fd);
+      return EXIT_FAILURE;
+    }
+    unlink(sock_path);
+  }
+
+  // only the owner may connect: requests run arbitrary commands
+  mode_t old_mask = umask(077);
+  int ret = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_mask);
+  if (ret == -1) {
+    perror("arsh: bind");
+    close(listen_fd);
+    return EXIT_FAILURE;
+  }
+
+  if (listen(listen_fd, SOMAXCONN) == -1) {
+    perror("arsh: listen");
+    close(listen_fd);
+    return EXIT_FAILURE;
+  }
+
+  fprintf(stderr, "arsh: serving on %s (pid %d)\n", sock_path, getpid());
+
+  while (1) {
+    // reap finished request handlers
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+      ;
+
+    int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("arsh: accept");
+      break;
+    }
+
+    handle_connection(listen_fd, conn);
+    close(conn);
+  }
+
+  close(listen_fd);
+  unlink(sock_path);
+  return EXIT_FAILURE;
+}
+
+int arsh_client(const char *sock_path, int kind, const char *body) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "arsh: socket path too long\n");
+    return EXIT_FAILURE;
+  }
+  strcpy(addr.sun_path, sock_path);
+
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL) {
+    perror("arsh: getcwd");
+    return EXIT_FAILURE;
+  }
+
+  // the server runs in another cwd, so scripts are sent by absolute path
+  char script[PATH_MAX];
+  if (kind == ARSH_REQ_SCRIPT) {
+    if (realpath(body, script) == NULL) {
+      perror("arsh");
+      return EXIT_FAILURE;
+    }
+    body = script;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("arsh: socket");
+    return EXIT_FAILURE;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    perror("arsh: connect");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  struct arsh_request_hdr hdr = {.kind = kind,
+                                 .cwd_len = strlen(cwd),
+                                 .body_len = strlen(body)};
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {.iov_base = &hdr, .iov_len = sizeof(hdr)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(fd, &msg, 0) != sizeof(hdr) ||
+      write_full(fd, cwd, hdr.cwd_len) == -1 ||
+      write_full(fd, body, hdr.body_len) == -1) {
+    perror("arsh: send request");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  int32_t status;
+  if (read_full(fd, &status, sizeof(status)) == -1) {
+    fprintf(stderr, "arsh: server closed connection without a status\n");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  close(fd);
+  return status;
+}
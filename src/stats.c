@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+
+#include "../include/stats.h"
+#include "../include/shell.h"
+#include <errno.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// children that have been forked but not yet reaped
+struct pending_child {
+  pid_t pid;
+  char name[ARSH_STATS_NAME_MAX];
+  struct timespec start;
+};
+
+// wall time samples of every finished run of one command name
+struct cmd_samples {
+  char name[ARSH_STATS_NAME_MAX];
+  double *wall_ms;
+  int count;
+  int cap;
+};
+
+static struct pending_child *pending = NULL;
+static int pending_count = 0;
+static int pending_cap = 0;
+
+static struct cmd_samples *samples = NULL;
+static int samples_count = 0;
+static int samples_cap = 0;
+
+// state of the active `time` keyword
+static int timing_depth = 0;
+static struct timespec timing_start;
+static struct arsh_proc_stats *timed = NULL;
+static int timed_count = 0;
+static int timed_cap = 0;
+
+static double elapsed_ms(const struct timespec *from,
+                         const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000.0 +
+         (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static double timeval_ms(const struct timeval *tv) {
+  return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+static void *grow(void *ptr, int *cap, size_t elem_size) {
+  *cap = *cap ? *cap * 2 : 16;
+  ptr = realloc(ptr, *cap * elem_size);
+  if (!ptr) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+void arsh_stats_track(pid_t pid, const char *name) {
+  if (pending_count >= pending_cap)
+    pending = grow(pending, &pending_cap, sizeof(*pending));
+
+  struct pending_child *p = &pending[pending_count++];
+  p->pid = pid;
+  snprintf(p->name, sizeof(p->name), "%s", name ? name : "?");
+  clock_gettime(CLOCK_MONOTONIC, &p->start);
+}
+
+void arsh_json_write_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c == '\n')
+      fputs("\\n", out);
+    else if (c == '\t')
+      fputs("\\t", out);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+static int exit_code(int status) {
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return -1;
+}
+
+// append one record to $ARSH_STATS_LOG as a JSON line
+static void log_record(const struct arsh_proc_stats *s) {
+  char *path = getenv("ARSH_STATS_LOG");
+  if (path == NULL || path[0] == '\0')
+    return;
+
+  FILE *log = fopen(path, "a");
+  if (!log) {
+    perror("arsh: stats log");
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  fprintf(log, "{\"ts\":%ld.%03ld,\"pid\":%d,\"cmd\":", (long)now.tv_sec,
+          now.tv_nsec / 1000000, (int)s->pid);
+  arsh_json_write_string(log, s->name);
+  fprintf(log,
+          ",\"status\":%d,\"wall_ms\":%.3f,\"user_ms\":%.3f,\"sys_ms\":%.3f,"
+          "\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,"
+          "\"inblock\":%ld,\"oublock\":%ld}\n",
+          exit_code(s->status), s->wall_ms, s->user_ms, s->sys_ms,
+          s->max_rss_kb, s->nvcsw, s->nivcsw, s->inblock, s->oublock);
+  fclose(log);
+}
+
+static void add_sample(const struct arsh_proc_stats *s) {
+  struct cmd_samples *cs = NULL;
+  for (int i = 0; i < samples_count; i++) {
+    if (strcmp(samples[i].name, s->name) == 0) {
+      cs = &samples[i];
+      break;
+    }
+  }
+
+  if (cs == NULL) {
+    if (samples_count >= samples_cap)
+      samples = grow(samples, &samples_cap, sizeof(*samples));
+    cs = &samples[samples_count++];
+    memset(cs, 0, sizeof(*cs));
+    snprintf(cs->name, sizeof(cs->name), "%s", s->name);
+  }
+
+  if (cs->count >= cs->cap)
+    cs->wall_ms = grow(cs->wall_ms, &cs->cap, sizeof(double));
+  cs->wall_ms[cs->count++] = s->wall_ms;
+}
+
+static void record(const struct arsh_proc_stats *s) {
+  add_sample(s);
+  log_record(s);
+
+  if (timing_depth > 0) {
+    if (timed_count >= timed_cap)
+      timed = grow(timed, &timed_cap, sizeof(*timed));
+    timed[timed_count++] = *s;
+  }
+}
+
+// waitpid() replacement that reaps with wait4() and records the child's
+// resource usage. Stopped children are returned without being recorded.
+// EINTR is retried; on any other failure -1 is returned and *status and
+// *out are left alone, so callers must stop waiting on -1.
+pid_t arsh_stats_wait(pid_t pid, int *status, int options,
+                      struct arsh_proc_stats *out) {
+  struct rusage ru;
+  int st;
+  pid_t ret;
+  do {
+    ret = wait4(pid, &st, options, &ru);
+  } while (ret == -1 && errno == EINTR);
+
+  if (ret <= 0)
+    return ret;
+  if (status)
+    *status = st;
+  if (!WIFEXITED(st) && !WIFSIGNALED(st))
+    return ret;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  struct arsh_proc_stats s;
+  memset(&s, 0, sizeof(s));
+  s.pid = ret;
+  s.status = st;
+  snprintf(s.name, sizeof(s.name), "?");
+
+  for (int i = 0; i < pending_count; i++) {
+    if (pending[i].pid == ret) {
+      memcpy(s.name, pending[i].name, sizeof(s.name));
+      s.wall_ms = elapsed_ms(&pending[i].start, &now);
+      pending[i] = pending[--pending_count];
+      break;
+    }
+  }
+
+  s.user_ms = timeval_ms(&ru.ru_utime);
+  s.sys_ms = timeval_ms(&ru.ru_stime);
+  s.max_rss_kb = ru.ru_maxrss;
+  s.nvcsw = ru.ru_nvcsw;
+  s.nivcsw = ru.ru_nivcsw;
+  s.inblock = ru.ru_inblock;
+  s.oublock = ru.ru_oublock;
+
+  record(&s);
+  if (out)
+    *out = s;
+  return ret;
+}
+
+void arsh_time_begin() {
+  if (timing_depth++ > 0)
+    return;
+  timed_count = 0;
+  clock_gettime(CLOCK_MONOTONIC, &timing_start);
+}
+
+// nonzero while a time prefix is measuring the current command
+int arsh_time_active() { return timing_depth > 0; }
+
+void arsh_time_end() {
+  if (timing_depth == 0 || --timing_depth > 0)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  struct arsh_proc_stats total;
+  memset(&total, 0, sizeof(total));
+
+  if (timed_count > 1) {
+    fprintf(stderr, "%10s %10s %10s %10s %6s %6s %6s %6s  %s\n", "wall(ms)",
+            "user(ms)", "sys(ms)", "maxrss(KB)", "vcsw", "ivcsw", "inblk",
+            "oublk", "command");
+  }
+
+  for (int i = 0; i < timed_count; i++) {
+    struct arsh_proc_stats *s = &timed[i];
+    if (timed_count > 1) {
+      fprintf(stderr, "%10.3f %10.3f %10.3f %10ld %6ld %6ld %6ld %6ld  %s\n",
+              s->wall_ms, s->user_ms, s->sys_ms, s->max_rss_kb, s->nvcsw,
+              s->nivcsw, s->inblock, s->oublock, s->name);
+    }
+    total.user_ms += s->user_ms;
+    total.sys_ms += s->sys_ms;
+    if (s->max_rss_kb > total.max_rss_kb)
+      total.max_rss_kb = s->max_rss_kb;
+    total.nvcsw += s->nvcsw;
+    total.nivcsw += s->nivcsw;
+    total.inblock += s->inblock;
+    total.oublock += s->oublock;
+  }
+
+  fprintf(stderr, "\nreal    %.3fs\n", elapsed_ms(&timing_start, &now) / 1000);
+  fprintf(stderr, "user    %.3fs\n", total.user_ms / 1000);
+  fprintf(stderr, "sys     %.3fs\n", total.sys_ms / 1000);
+  fprintf(stderr, "maxrss  %ld KB\n", total.max_rss_kb);
+  fprintf(stderr, "ctxsw   %ld voluntary, %ld involuntary\n", total.nvcsw,
+          total.nivcsw);
+  fprintf(stderr, "io      %ld blocks in, %ld blocks out\n", total.inblock,
+          total.oublock);
+
+  timed_count = 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of a sorted array
+static double percentile(const double *sorted, int n, int p) {
+  int rank = (p * n + 99) / 100;
+  if (rank < 1)
+    rank = 1;
+  return sorted[rank - 1];
+}
+
+void arsh_stats_report(FILE *out) {
+  if (samples_count == 0) {
+    fprintf(out, "arsh: no commands recorded yet\n");
+    return;
+  }
+
+  fprintf(out, "%-20s %6s %10s %10s %10s %10s %10s\n", "command", "runs",
+          "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)", "total(ms)");
+
+  for (int i = 0; i < samples_count; i++) {
+    struct cmd_samples *cs = &samples[i];
+    double *sorted = malloc(cs->count * sizeof(double));
+    if (!sorted) {
+      fprintf(stderr, "arsh: allocation error\n");
+      return;
+    }
+    memcpy(sorted, cs->wall_ms, cs->count * sizeof(double));
+    qsort(sorted, cs->count, sizeof(double), cmp_double);
+
+    double total = 0;
+    for (int j = 0; j < cs->count; j++)
+      total += sorted[j];
+
+    fprintf(out, "%-20s %6d %10.3f %10.3f %10.3f %10.3f %10.3f\n", cs->name,
+            cs->count, percentile(sorted, cs->count, 50),
+            percentile(sorted, cs->count, 90),
+            percentile(sorted, cs->count, 99), sorted[cs->count - 1], total);
+    free(sorted);
+  }
+}
+
+void arsh_stats_reset() {
+  for (int i = 0; i < samples_count; i++)
+    free(samples[i].wall_ms);
+  samples_count = 0;
+}
@@ -0,0 +1,365 @@
+#define _GNU_SOURCE
+
+#include "../include/tee.h"
+#include "../include/shell.h"
+#include "../include/stats.h"
+#include <errno.h>
+
+#define ARSH_TEE_CHUNK (1 << 16)
+
+// zsh-style multios: "cmd > a > b | next" sends cmd's output to a, b and
+// next at once. The command writes into one pipe and a shell thread fans
+// it out: tee(2) duplicates the pipe's pages into a private pipe per
+// target and splice(2) moves them on, so the bytes are never copied
+// through user space.
+
+static int is_output(const char *arg) {
+  return strcmp(arg, ">") == 0 || strcmp(arg, ">>") == 0;
+}
+
+// number of > and >> redirections in args
+int arsh_tee_outputs(char **args) {
+  int n = 0;
+  for (int i = 0; args[i] != NULL; i++) {
+    if (is_output(args[i]) && args[i + 1] != NULL)
+      n++;
+  }
+  return n;
+}
+
+static void free_tee(struct arsh_tee *tee) {
+  for (int i = 0; i < tee->n; i++)
+    free(tee->targets[i].name);
+  free(tee->targets);
+  free(tee);
+}
+
+// Open every output target of args (removing the redirections from it),
+// plus pipe_fd unless it is -1, and make the pipe the command should use
+// as stdout. Returns NULL, with nothing left open, on error.
+struct arsh_tee *arsh_tee_setup(char **args, int pipe_fd, int *out_fd) {
+  struct arsh_tee *tee = calloc(1, sizeof(*tee));
+  int max = arsh_tee_outputs(args) + 1;
+  if (tee)
+    tee->targets = calloc(max, sizeof(struct arsh_tee_target));
+  if (!tee || !tee->targets) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < max; i++)
+    tee->targets[i].tmp[0] = tee->targets[i].tmp[1] = -1;
+  tee->report = arsh_time_active();
+
+  for (int i = 0; args[i] != NULL; i++) {
+    if (!is_output(args[i]) || args[i + 1] == NULL)
+      continue;
+
+    int flags = strcmp(args[i], ">>") == 0 ? O_APPEND : O_TRUNC;
+    int fd = open(args[i + 1], O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0644);
+    if (fd == -1) {
+      perror("arsh: open");
+      goto fail;
+    }
+    tee->targets[tee->n].fd = fd;
+    tee->targets[tee->n].name = strdup(args[i + 1]);
+    tee->n++;
+    i++;
+  }
+
+  if (pipe_fd != -1) {
+    tee->targets[tee->n].fd = pipe_fd;
+    tee->targets[tee->n].name = strdup("| (pipe)");
+    tee->n++;
+  }
+
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) < 0) {
+    perror("arsh: pipe");
+    goto fail;
+  }
+  tee->in_fd = pipefd[0];
+  *out_fd = pipefd[1];
+
+  for (int i = 0; i < tee->n; i++) {
+    struct arsh_tee_target *t = &tee->targets[i];
+    // the last live target is fed straight from in_fd, the rest need a
+    // private pipe for tee(2); any of them may end up last
+    if (pipe2(t->tmp, O_CLOEXEC) < 0) {
+      perror("arsh: pipe");
+      close(pipefd[0]);
+      close(pipefd[1]);
+      goto fail;
+    }
+  }
+
+  // everything opened: the command itself no longer sees the redirections
+  int k = 0;
+  for (int i = 0; args[i] != NULL; i++) {
+    if (is_output(args[i]) && args[i + 1] != NULL)
+      i++;
+    else
+      args[k++] = args[i];
+  }
+  args[k] = NULL;
+  return tee;
+
+fail:
+  for (int i = 0; i < tee->n; i++) {
+    struct arsh_tee_target *t = &tee->targets[i];
+    if (t->fd != pipe_fd)
+      close(t->fd);
+    if (t->tmp[0] != -1) {
+      close(t->tmp[0]);
+      close(t->tmp[1]);
+    }
+  }
+  free_tee(tee);
+  return NULL;
+}
+
+// move bytes from a pipe into t, falling back to read/write if the target
+// refuses splice (e.g. files opened O_APPEND). On failure t is marked dead
+// and the rest of the bytes are drained so the pipe stays in step.
+static void move(int from, struct arsh_tee_target *t, size_t bytes,
+                 char *buf) {
+  while (bytes > 0 && !t->dead) {
+    ssize_t n;
+#ifdef __linux__
+    if (!t->copy) {
+      n = splice(from, NULL, t->fd, NULL, bytes, SPLICE_F_MOVE);
+      if (n < 0 && errno == EINVAL) {
+        t->copy = 1;
+        continue;
+      }
+    } else
+#endif
+    {
+      n = read(from, buf, bytes < ARSH_TEE_CHUNK ? bytes : ARSH_TEE_CHUNK);
+      for (ssize_t off = 0; n > 0 && off < n;) {
+        ssize_t w = write(t->fd, buf + off, n - off);
+        if (w < 0 && errno == EINTR)
+          continue;
+        if (w <= 0) {
+          n = -1;
+          break;
+        }
+        off += w;
+      }
+    }
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (n < 0 && errno != EPIPE)
+        fprintf(stderr, "arsh: tee %s: %s\n", t->name, strerror(errno));
+      t->dead = 1;
+      break;
+    }
+    t->bytes += n;
+    bytes -= n;
+  }
+
+  while (bytes > 0) {
+    ssize_t n = read(from, buf, bytes < ARSH_TEE_CHUNK ? bytes : ARSH_TEE_CHUNK);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    bytes -= n;
+  }
+}
+
+// write all of buf to t, marking it dead if that fails
+static void write_to(struct arsh_tee_target *t, const char *buf, size_t n) {
+  for (size_t off = 0; !t->dead && off < n;) {
+    ssize_t w = write(t->fd, buf + off, n - off);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0) {
+      if (w < 0 && errno != EPIPE)
+        fprintf(stderr, "arsh: tee %s: %s\n", t->name, strerror(errno));
+      t->dead = 1;
+      return;
+    }
+    off += w;
+  }
+  t->bytes += n;
+}
+
+// one chunk from in_fd straight into t, once it is the only target left.
+// Returns 0 at the end of the input.
+static int feed(int in_fd, struct arsh_tee_target *t, char *buf) {
+  ssize_t n;
+#ifdef __linux__
+  if (!t->copy) {
+    n = splice(in_fd, NULL, t->fd, NULL, ARSH_TEE_CHUNK, SPLICE_F_MOVE);
+    if (n > 0) {
+      t->bytes += n;
+      return 1;
+    }
+    if (n == 0)
+      return 0;
+    if (errno == EINVAL)
+      t->copy = 1;
+    else if (errno != EINTR) {
+      if (errno != EPIPE)
+        fprintf(stderr, "arsh: tee %s: %s\n", t->name, strerror(errno));
+      t->dead = 1;
+    }
+    return 1;
+  }
+#endif
+  n = read(in_fd, buf, ARSH_TEE_CHUNK);
+  if (n < 0 && errno == EINTR)
+    return 1;
+  if (n <= 0)
+    return 0;
+  write_to(t, buf, n);
+  return 1;
+}
+
+// bytes per target, only when time or profile asked for numbers
+static void report(struct arsh_tee *tee) {
+  if (!tee->report)
+    return;
+  for (int i = 0; i < tee->n; i++) {
+    struct arsh_tee_target *t = &tee->targets[i];
+    fprintf(stderr, "arsh: tee %s: %llu bytes%s\n", t->name, t->bytes,
+            t->dead ? " (closed early)" : "");
+  }
+}
+
+static void *tee_main(void *arg) {
+  struct arsh_tee *relay = arg;
+  char *buf = malloc(ARSH_TEE_CHUNK);
+  if (!buf) {
+    fprintf(stderr, "arsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // a target that goes away must not take the whole shell down
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  int use_tee = 1;
+#ifndef __linux__
+  use_tee = 0;
+#endif
+
+  while (1) {
+    int last = -1, live = 0;
+    for (int i = 0; i < relay->n; i++) {
+      if (!relay->targets[i].dead) {
+        last = i;
+        live++;
+      }
+    }
+    if (live == 0)
+      break;
+    if (live == 1) {
+      if (!feed(relay->in_fd, &relay->targets[last], buf))
+        break;
+      continue;
+    }
+
+    if (!use_tee) {
+      // read each chunk once and write it to every target
+      ssize_t n = read(relay->in_fd, buf, ARSH_TEE_CHUNK);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      for (int i = 0; i <= last; i++) {
+        if (!relay->targets[i].dead)
+          write_to(&relay->targets[i], buf, n);
+      }
+      continue;
+    }
+
+#ifdef __linux__
+    // Duplicate the pending pages into each target's private pipe and
+    // splice them on. The first tee blocks for input and fixes the chunk
+    // size; the private pipes start empty and are as large as in_fd, so
+    // the later ones duplicate exactly the same bytes.
+    ssize_t bytes = 0;
+    for (int i = 0; i < last && use_tee; i++) {
+      struct arsh_tee_target *t = &relay->targets[i];
+      if (t->dead)
+        continue;
+
+      ssize_t n = tee(relay->in_fd, t->tmp[1], bytes ? (size_t)bytes
+                                                   : ARSH_TEE_CHUNK, 0);
+      if (n < 0 && errno == EINTR) {
+        i--;
+        continue;
+      }
+      if (bytes == 0) {
+        if (n < 0 && errno == EINVAL) {
+          use_tee = 0;
+          break;
+        }
+        if (n <= 0)
+          goto done;
+        bytes = n;
+      } else if (n != bytes) {
+        fprintf(stderr, "arsh: tee %s: short tee\n", t->name);
+        t->dead = 1;
+      }
+      if (n > 0)
+        move(t->tmp[0], t, n, buf);
+    }
+
+    // the last live target takes the chunk out of in_fd itself
+    if (use_tee)
+      move(relay->in_fd, &relay->targets[last], bytes, buf);
+#endif
+  }
+
+#ifdef __linux__
+done:
+#endif
+  // closing in_fd early gives the command EPIPE once every target is gone
+  close(relay->in_fd);
+  for (int i = 0; i < relay->n; i++) {
+    struct arsh_tee_target *t = &relay->targets[i];
+    close(t->fd);
+    close(t->tmp[0]);
+    close(t->tmp[1]);
+  }
+  free(buf);
+
+  if (relay->detached) {
+    report(relay);
+    free_tee(relay);
+  }
+  return NULL;
+}
+
+int arsh_tee_start(struct arsh_tee *tee, int detached) {
+  tee->detached = detached;
+
+  int err = pthread_create(&tee->thread, NULL, tee_main, tee);
+  if (err != 0) {
+    fprintf(stderr, "arsh: tee thread: %s\n", strerror(err));
+    close(tee->in_fd);
+    for (int i = 0; i < tee->n; i++) {
+      close(tee->targets[i].fd);
+      close(tee->targets[i].tmp[0]);
+      close(tee->targets[i].tmp[1]);
+    }
+    free_tee(tee);
+    return -1;
+  }
+  if (detached)
+    pthread_detach(tee->thread);
+  return 0;
+}
+
+// wait for the relay to drain, then report bytes per target if asked
+void arsh_tee_finish(struct arsh_tee *tee) {
+  pthread_join(tee->thread, NULL);
+  report(tee);
+  free_tee(tee);
+}